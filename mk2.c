@@ -6,6 +6,30 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/bitmap.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "mk2.h"
+#include "mk2_proto.h"
+#include "mk2_kunit.h"
+
+#define CREATE_TRACE_POINTS
+#include "mk2_trace.h"
 
 #define AUTHOR		"Patryk Wlazłyń"
 #define DESCRIPTION	"Driver for novation mk2 launchpad";
@@ -18,14 +42,38 @@
 #define MK2_MAX_TRANSFER	128
 
 #define WRITES_IN_FLIGHT	8
+#define MK2_MAX_WRITE_DEPTH	64
 
-// 407 = header + packet * 80 + footer = 6 + 5 * 80 + 1
-#define USB_MK2_MAX_OUT_LEN	((size_t) 407)
+// Upper bound of read buffer, in multiples of endpoint's max packet size
+#define MK2_MAX_READ_PACKETS	64
+
+#define MK2_READ_URBS		4
+#define MK2_MAX_READ_URBS	32
+
+// Transfer errors in a row a read urb is resubmitted after, then the pipe
+// is restarted with a delay
+#define MK2_READ_RETRIES	8
+#define MK2_READ_RESTART_DELAY_MS	100
+
+// Decoded input waiting for readers, in events
+#define MK2_EVENT_QUEUE_SIZE	256
+#define MK2_MAX_EVENT_QUEUE_SIZE	4096
 
 #define MK2_SYSEX_PACKET_SIZE	3
 #define MK2_STUFFED_PACKET_SIZE	4
 #define MK2_SYSEX_SIZE_ROUND_UP	2
 
+// Size of a write urb buffer, same as compute_stuffed_size(USB_MK2_MAX_OUT_LEN)
+#define MK2_WRITE_SLOT_SIZE	((USB_MK2_MAX_OUT_LEN + MK2_SYSEX_SIZE_ROUND_UP) \
+				 / MK2_SYSEX_PACKET_SIZE * MK2_STUFFED_PACKET_SIZE)
+
+// Payload that fits in one write urb, whole packets only
+#define MK2_WRITE_SLOT_PAYLOAD	(MK2_WRITE_SLOT_SIZE / MK2_STUFFED_PACKET_SIZE \
+				 * MK2_SYSEX_PACKET_SIZE)
+
+// Staging block for pulling payload from userspace, must be whole packets
+#define MK2_STUFF_CHUNK_SIZE	(MK2_SYSEX_PACKET_SIZE * 16)
+
 #define MK2_SYSEX_MOREDATA	0x04
 #define MK2_SYSEX_DATAEND1	0x05
 #define MK2_SYSEX_DATAEND2	0x06
@@ -33,48 +81,314 @@
 #define MK2_SYSEX_BUTTON	0x09
 #define MK2_SYSEX_SBUTTON	0x0b
 
-static struct usb_driver mk2_driver;
+// Launchpad MK2 programmer's reference, sysex commands
+#define MK2_SYSEX_END		0xf7
+#define MK2_CMD_LED_PALETTE	0x0a
+#define MK2_CMD_LED_RGB		0x0b
+#define MK2_CMD_COLUMN		0x0c
+#define MK2_CMD_ROW		0x0d
+#define MK2_CMD_ALL_PALETTE	0x0e
+#define MK2_CMD_SCROLL_TEXT	0x14
+#define MK2_CMD_FLASH		0x23
+#define MK2_CMD_PULSE		0x28
+
+// Rows and columns the row and column commands take, the 9th being the top
+// row and the side column respectively
+#define MK2_ROWS		9
+#define MK2_COLUMNS		9
+
+// Most commands a single MK2_IOC_COMMANDS takes
+#define MK2_MAX_COMMANDS	64
+
+#define MK2_TOP_ROW_FIRST_LED	104
+
+#define MK2_MAX_REFRESH_RATE	1000
+
+// Longest clip, about 1.3MB of frames
+#define MK2_MAX_CLIP_FRAMES	4096
+
+// Messages waiting for their transmit time, per device
+#define MK2_MAX_TIMED_MSGS	256
+
+// How long closing a file waits for its output to reach the device
+#define MK2_FLUSH_TIMEOUT_MS	1000
+
+#define MK2_DEFAULT_WRITE_WEIGHT	1
+#define MK2_MAX_WRITE_WEIGHT	16
+
+// Flags of a single write
+#define MK2_WRITE_NONBLOCK	(1 << 0)
+#define MK2_WRITE_PRIORITY	(1 << 1)
+// buffer holds whole stuffed messages, at most one urb of them
+#define MK2_WRITE_STUFFED	(1 << 2)
+
+static unsigned int coalesce_us = 1000;
+module_param(coalesce_us, uint, 0644);
+MODULE_PARM_DESC(coalesce_us,
+	"How long a write may wait for further messages to share its urb "
+	"while another urb is in flight, in microseconds (0 disables)");
+
+static unsigned int write_depth = WRITES_IN_FLIGHT;
+module_param(write_depth, uint, 0644);
+MODULE_PARM_DESC(write_depth,
+	"Default number of write urbs in flight per device (1-"
+	__stringify(MK2_MAX_WRITE_DEPTH) ")");
+
+static unsigned int read_buffer_size;
+module_param(read_buffer_size, uint, 0644);
+MODULE_PARM_DESC(read_buffer_size,
+	"Default read buffer size in bytes, rounded up to the endpoint's max "
+	"packet size (0 means one packet)");
+
+static unsigned int read_urbs = MK2_READ_URBS;
+module_param(read_urbs, uint, 0644);
+MODULE_PARM_DESC(read_urbs,
+	"Default number of read urbs kept submitted per device (1-"
+	__stringify(MK2_MAX_READ_URBS) ")");
+
+static unsigned int refresh_rate;
+module_param(refresh_rate, uint, 0644);
+MODULE_PARM_DESC(refresh_rate,
+	"Default framebuffer refresh rate in Hz, 0 sends every update right "
+	"away (up to " __stringify(MK2_MAX_REFRESH_RATE) ")");
+
+static unsigned int event_queue_size = MK2_EVENT_QUEUE_SIZE;
+module_param(event_queue_size, uint, 0444);
+MODULE_PARM_DESC(event_queue_size,
+	"Number of input events queued per device for readers, rounded up to "
+	"a power of 2 (2-" __stringify(MK2_MAX_EVENT_QUEUE_SIZE) ")");
+
+static DEFINE_STATIC_KEY_FALSE(mk2_hexdump);
+
+static int mk2_hexdump_set(const char *val, const struct kernel_param *kp)
+{
+	bool enable;
+	int retval;
+
+	retval = kstrtobool(val, &enable);
+	if (retval)
+		return retval;
+
+	if (enable)
+		static_branch_enable(&mk2_hexdump);
+	else
+		static_branch_disable(&mk2_hexdump);
+
+	return 0;
+}
 
-struct mk2_read_buffer
+static int mk2_hexdump_get(char *buffer, const struct kernel_param *kp)
 {
-	unsigned char	*data;
-	size_t		size;
-	size_t		filled;
-	size_t		copied;
+	return sprintf(buffer, "%c\n", static_key_enabled(&mk2_hexdump) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops mk2_hexdump_ops = {
+	.set = mk2_hexdump_set,
+	.get = mk2_hexdump_get,
 };
+module_param_cb(hexdump, &mk2_hexdump_ops, NULL, 0644);
+MODULE_PARM_DESC(hexdump,
+	"Dump every transfer to the kernel log, costs nothing while disabled");
 
-void *mk2_read_buffer_alloc(struct mk2_read_buffer *read_buffer, size_t size)
-{
-	read_buffer->data = kmalloc(size, GFP_KERNEL);
-	read_buffer->size = size;
-	read_buffer->filled = 0;
-	read_buffer->copied = 0;
+static struct usb_driver mk2_driver;
 
-	return read_buffer->data;
-}
+/*
+ * Read URB with its DMA buffer. All of them stay submitted while the device
+ * is open and are resubmitted straight from the completion handler.
+ */
+struct mk2_read_slot
+{
+	struct mk2dev		*dev;
+	struct urb		*urb;
+	unsigned char		*buf;
+	ktime_t			submitted;
+};
 
 struct mk2_read_endp
 {
-	struct mk2_read_buffer	buffer;
-	struct urb		*urb;
+	struct mk2_read_slot	*slots;
+	unsigned int		nr_slots;
+	size_t			slot_size;
+	unsigned int		maxp;
+	struct usb_anchor	submitted;
+	// Number of open files, urbs are armed while nonzero
+	unsigned int		armed;
+	// Protects slots and armed
+	struct mutex		urbs_mutex;
+	// Filled only by urb completions, which the usb core serializes per
+	// endpoint, and drained only by readers holding io_mutex. Having a
+	// single producer and a single consumer it needs no locking.
+	DECLARE_KFIFO_PTR(events, struct mk2_event);
+	// Counts received events, dropped ones too, only touched by completions
+	u32			sequence;
+	// Serializes readers and protects batch and staging
 	struct mutex		io_mutex;
+	struct mk2_event	batch[MK2_READ_BATCH];
+	// Output of a read, copied to userspace at once. Payload is stored a
+	// word at a time, hence the slack.
+	u8			staging[MK2_READ_BATCH * sizeof(struct mk2_input_event)
+					+ sizeof(u32)];
 	wait_queue_head_t	wait_queue;
 	spinlock_t 		err_lock;
 	int 			errors;
+	// Consecutive transfer errors, only touched by completions and by
+	// recover_work with every urb killed
+	unsigned int		retries;
+	// Clears a halt and restarts the urbs
+	struct delayed_work	recover_work;
 	__u8			address;
-	bool			requested_read;
 };
 
+/*
+ * Message queued to be sent at a given time
+ */
+struct mk2_timed_msg
+{
+	struct list_head	node;
+	ktime_t			time;
+	size_t			len;
+	// Response of a reaction, may take the priority slot
+	bool			reaction;
+	char			data[];
+};
+
+/*
+ * Preallocated write URB together with its DMA buffer. Slots live on the
+ * endpoint's free list whenever they are neither in flight nor pending.
+ */
+struct mk2_write_slot
+{
+	struct list_head	node;
+	struct mk2dev		*dev;
+	struct urb		*urb;
+	char			*buf;
+	size_t			len;
+	ktime_t			deadline;
+	ktime_t			submitted;
+};
+
+struct mk2_write_ctx;
+
 struct mk2_write_endp
 {
 	struct usb_anchor	submitted;
 	struct semaphore	limit_sem;
+	struct list_head	free_slots;
+	// Slot collecting messages while other urbs are in flight
+	struct mk2_write_slot	*pending;
+	unsigned int		in_flight;
+	unsigned int		peak_in_flight;
+	// Counts of urbs submitted and completed, for barriers
+	unsigned int		submit_seq;
+	unsigned int		complete_seq;
+	// Set while a write split over several urbs is being queued, priority
+	// messages must not end up between its parts
+	bool			split;
+	// Number of allocated slots, changed only with io_mutex held
+	unsigned int		depth;
+	struct hrtimer		coalesce_timer;
+	// Messages with a transmit time, in time order, see mk2_timed_send
+	struct list_head	timed;
+	unsigned int		nr_timed;
+	struct hrtimer		timed_timer;
+	// Protects timed and nr_timed, nests outside of slots_lock
+	spinlock_t		timed_lock;
+	// Protects free_slots, pending and in_flight, serializes submission
+	spinlock_t		slots_lock;
 	struct mutex		io_mutex;
+	// Slot only priority writes may use, guarded by prio_sem and
+	// serialized by prio_mutex, never on the free list
+	struct mk2_write_slot	*prio_slot;
+	struct semaphore	prio_sem;
+	struct mutex		prio_mutex;
+	// Woken whenever a slot returns to the free list or split clears
+	wait_queue_head_t	wait_queue;
+	// Files waiting for their turn to write, by finish tag
+	struct list_head	sched_queue;
+	// File whose writer may take io_mutex now
+	struct mk2_write_ctx	*sched_owner;
+	// Finish tag of the write being served
+	u64			sched_vtime;
+	// Protects sched_queue, sched_owner, sched_vtime and finish tags
+	spinlock_t		sched_lock;
+	wait_queue_head_t	sched_wait;
 	spinlock_t		err_lock;
 	int errors;
 	__u8			address;
 };
 
+/*
+ * Driver side copy of what the device displays. Commits are diffed against
+ * shadow, so only LEDs that changed go over the wire.
+ */
+struct mk2_fb
+{
+	struct mutex		lock;
+	struct mk2_frame	shadow;
+	// Latest frame requested by userspace
+	struct mk2_frame	next;
+	// Frame being received from userspace, not validated yet
+	struct mk2_frame	staging;
+	// False until the device state is known, forces a full update
+	bool			valid;
+	// next differs from shadow and waits for the pipe to drain
+	bool			dirty;
+	// next came from a priority file and goes out on the priority lane
+	bool			priority;
+	// LEDs a reaction changed behind shadow's back, resent on next commit
+	DECLARE_BITMAP(overridden, MK2_LED_COUNT);
+	struct work_struct	work;
+	// Refresh period, 0 when updates go out right away. Set under lock.
+	unsigned int		refresh_rate;
+	u64			vblank_ns;
+	struct hrtimer		vblank_timer;
+	// Protects vblank_seq and vblank_time
+	spinlock_t		vblank_lock;
+	u64			vblank_seq;
+	ktime_t			vblank_time;
+	wait_queue_head_t	vblank_wait;
+	char			msg[USB_MK2_MAX_OUT_LEN];
+	// MK2_FB_BUFFERS user mappable pages, one frame at the start of each
+	void			*pages;
+	unsigned int		back;
+};
+
+/*
+ * Frames played into the framebuffer by the driver, see mk2_clip_work.
+ * Protected by fb->lock.
+ */
+struct mk2_clip
+{
+	struct mk2_frame	*frames;
+	unsigned int		nr_frames;
+	unsigned int		pos;
+	bool			playing;
+	bool			loop;
+	// Frame period, 0 once playback stops
+	u64			period_ns;
+	struct hrtimer		timer;
+	struct work_struct	work;
+};
+
+struct mk2_react_rule
+{
+	u8			action;
+	u8			target;
+	struct mk2_led		led;
+};
+
+/*
+ * Reactions to button presses and releases, evaluated in the read
+ * completion. Indexed by LED index of the button, then by edge.
+ */
+struct mk2_react
+{
+	// Protects rules and nr_rules, taken in the read completion
+	spinlock_t		lock;
+	unsigned int		nr_rules;
+	struct mk2_react_rule	rules[MK2_LED_COUNT][2];
+};
+
 struct mk2_state
 {
 	unsigned long
@@ -82,6 +396,97 @@ struct mk2_state
 		//suspended 	: 1;
 };
 
+// Urb statuses counted separately, everything else is counted as other
+static const struct {
+	int		status;
+	const char	*name;
+} mk2_stat_statuses[] = {
+	{ -ENOENT,	"ENOENT" },
+	{ -ECONNRESET,	"ECONNRESET" },
+	{ -ESHUTDOWN,	"ESHUTDOWN" },
+	{ -EPIPE,	"EPIPE" },
+	{ -EPROTO,	"EPROTO" },
+	{ -EILSEQ,	"EILSEQ" },
+	{ -ETIME,	"ETIME" },
+	{ -EOVERFLOW,	"EOVERFLOW" },
+	{ -ENODEV,	"ENODEV" },
+};
+
+#define MK2_STAT_STATUSES	(ARRAY_SIZE(mk2_stat_statuses) + 1)
+
+// Latency histogram bucket n counts [2^n, 2^(n+1)) ns, the last one anything
+// longer, about a second and up
+#define MK2_HIST_BUCKETS	31
+
+/*
+ * Per cpu event counters, summed up only when read through debugfs
+ */
+struct mk2_stats
+{
+	u64			write_submitted;
+	u64			write_completed;
+	u64			write_payload_bytes;
+	u64			write_stuffed_bytes;
+	// Time writers spent waiting for a free slot
+	u64			write_blocked_ns;
+	u64			write_status[MK2_STAT_STATUSES];
+	u64			read_submitted;
+	u64			read_completed;
+	u64			read_events;
+	// Events lost to a full input queue
+	u64			read_overruns;
+	u64			read_status[MK2_STAT_STATUSES];
+	// Write urb submission to completion
+	u64			write_latency[MK2_HIST_BUCKETS];
+	// Event reception to being copied to userspace
+	u64			read_latency[MK2_HIST_BUCKETS];
+};
+
+#define mk2_stat_inc(dev, field)	this_cpu_inc((dev)->stats->field)
+#define mk2_stat_add(dev, field, n)	this_cpu_add((dev)->stats->field, n)
+
+static unsigned int mk2_hist_bucket(s64 ns)
+{
+	if (ns <= 1)
+		return 0;
+
+	return min_t(unsigned int, ilog2(ns), MK2_HIST_BUCKETS - 1);
+}
+
+static unsigned int mk2_stat_status(int status)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(mk2_stat_statuses); ++i)
+		if (mk2_stat_statuses[i].status == status)
+			break;
+
+	return i;
+}
+
+/*
+ * Write side of an open file. Writers of one file queue on its mutex, files
+ * then share the device in proportion to their weight, see mk2_sched_enter.
+ */
+struct mk2_write_ctx
+{
+	struct list_head	node;
+	struct mutex		mutex;
+	unsigned int		weight;
+	// Virtual time by which the file's latest write should be done
+	u64			finish;
+};
+
+/*
+ * Per open file state
+ */
+struct mk2_file
+{
+	struct mk2dev		*dev;
+	unsigned int		flags;
+	struct mk2_write_ctx	write_ctx;
+};
+
 struct mk2dev
 {
 	struct usb_device	*udev;
@@ -89,29 +494,56 @@ struct mk2dev
 	struct kref		kref;
 	struct mk2_read_endp	read_endp;
 	struct mk2_write_endp	write_endp;
+	struct mk2_fb		fb;
+	struct mk2_clip		clip;
+	struct mk2_react	react;
 	struct mk2_state	state;
+	struct mk2_stats __percpu *stats;
+	struct dentry		*debugfs;
 };
 
+static struct dentry *mk2_debugfs_root;
+
+static const u8 mk2_sysex_header[] = { 0xf0, 0x00, 0x20, 0x29, 0x02, 0x18 };
+
+// Header is two whole packets, so stuffed it's the same in every message
+static char mk2_stuffed_header[8] __ro_after_init;
+
 static const struct usb_device_id mk2_idtable[] = {
 	{ USB_DEVICE(USB_MK2_VENDOR_ID, USB_MK2_PRODUCT_ID) },
 	{ }
 };
 MODULE_DEVICE_TABLE (usb, mk2_idtable);
 
+static void mk2_write_pool_free(struct mk2_write_endp *endpoint);
+static void mk2_read_slots_free(struct mk2dev *dev, struct mk2_read_slot *slots,
+				unsigned int nr_slots, size_t slot_size);
+static int mk2_read_submit_all(struct mk2_read_endp *endpoint);
+static int mk2_read_arm(struct mk2_read_endp *endpoint);
+static void mk2_read_disarm(struct mk2_read_endp *endpoint);
+
 static void mk2_delete(struct kref *kref)
 {
 	struct mk2dev *dev = container_of(kref, struct mk2dev, kref);
 
-	usb_free_urb(dev->read_endp.urb);
+	hrtimer_cancel(&dev->clip.timer);
+	cancel_work_sync(&dev->clip.work);
+	mk2_write_pool_free(&dev->write_endp);
+	free_percpu(dev->stats);
+	mk2_read_slots_free(dev, dev->read_endp.slots, dev->read_endp.nr_slots,
+			    dev->read_endp.slot_size);
+	kfifo_free(&dev->read_endp.events);
+	vfree(dev->fb.pages);
+	vfree(dev->clip.frames);
 	usb_put_intf(dev->interface);
 	usb_put_dev(dev->udev);
-	kfree(dev->read_endp.buffer.data);
 	kfree(dev);
 }
 
 static int mk2_open(struct inode *inode, struct file *file)
 {
 	struct mk2dev *dev;
+	struct mk2_file *mfile;
 	struct usb_interface *interface;
 	int subminor;
 	int retval = 0;
@@ -134,41 +566,279 @@ static int mk2_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
+	mfile = kzalloc(sizeof(*mfile), GFP_KERNEL);
+	if (!mfile) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	INIT_LIST_HEAD(&mfile->write_ctx.node);
+	mutex_init(&mfile->write_ctx.mutex);
+	mfile->write_ctx.weight = MK2_DEFAULT_WRITE_WEIGHT;
+
 	retval = usb_autopm_get_interface(interface);
 	if (retval)
-		goto exit;
+		goto error_free;
+
+	retval = mk2_read_arm(&dev->read_endp);
+	if (retval)
+		goto error_autopm;
 	
 	kref_get(&dev->kref);
 
-	file->private_data = dev;
+	mfile->dev = dev;
+	file->private_data = mfile;
+
+	return 0;
 
+error_autopm:
+	usb_autopm_put_interface(interface);
+error_free:
+	kfree(mfile);
 exit:
 	return retval;
 }
 
 static int mk2_release(struct inode *inode, struct file *file)
 {
+	struct mk2_file *mfile;
 	struct mk2dev *dev;
 
-	dev = file->private_data;
+	mfile = file->private_data;
 
-	if (unlikely(!dev))
+	if (unlikely(!mfile))
 		return -ENODEV;
-	
+
+	dev = mfile->dev;
+	kfree(mfile);
+
+	mk2_read_disarm(&dev->read_endp);
 	usb_autopm_put_interface(dev->interface);
 	kref_put(&dev->kref, mk2_delete);
 	return 0;
 }
 
+/*
+ * Takes a slot from the free list. Caller must own one count of limit_sem,
+ * which guarantees that the list is not empty.
+ */
+static struct mk2_write_slot *mk2_get_write_slot(struct mk2_write_endp *endpoint)
+{
+	struct mk2_write_slot *slot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+	slot = list_first_entry(&endpoint->free_slots, struct mk2_write_slot, node);
+	list_del(&slot->node);
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+
+	slot->len = 0;
+
+	return slot;
+}
+
+/*
+ * Returns slot to the free list and releases limit_sem count that was taken
+ * for it. Must be called with slots_lock held.
+ */
+static void __mk2_put_write_slot(struct mk2_write_endp *endpoint, struct mk2_write_slot *slot)
+{
+	if (slot == endpoint->prio_slot) {
+		up(&endpoint->prio_sem);
+		return;
+	}
+
+	list_add(&slot->node, &endpoint->free_slots);
+	up(&endpoint->limit_sem);
+}
+
+static void mk2_put_write_slot(struct mk2_write_endp *endpoint, struct mk2_write_slot *slot)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+	__mk2_put_write_slot(endpoint, slot);
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+}
+
+static void mk2_write_bulk_callback(struct urb *urb);
+static void mk2_timed_send(struct mk2_write_endp *endpoint);
+
+/*
+ * Submits slot's urb. Must be called with slots_lock held, which keeps urbs
+ * on the wire in the order they were queued. On failure the slot is returned
+ * to the free list.
+ */
+static int mk2_submit_write_slot(struct mk2_write_endp *endpoint, struct mk2_write_slot *slot)
+{
+	struct mk2dev *dev = slot->dev;
+	int retval;
+
+	if (unlikely(dev->state.disconnected)) {
+		retval = -ENODEV;
+		goto error;
+	}
+
+	usb_fill_bulk_urb(slot->urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, endpoint->address),
+			  slot->buf, slot->len, mk2_write_bulk_callback, slot);
+	slot->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	usb_anchor_urb(slot->urb, &endpoint->submitted);
+
+	slot->submitted = ktime_get();
+	retval = usb_submit_urb(slot->urb, GFP_ATOMIC);
+	trace_mk2_write_submit(dev->interface->minor, slot->len,
+			       endpoint->in_flight, retval);
+	if (retval) {
+		dev_err(&dev->interface->dev,
+			"%s - failed to submit write urb, error %d\n",
+			__func__, retval);
+		usb_unanchor_urb(slot->urb);
+		goto error;
+	}
+
+	++endpoint->in_flight;
+	++endpoint->submit_seq;
+	if (endpoint->in_flight > endpoint->peak_in_flight)
+		endpoint->peak_in_flight = endpoint->in_flight;
+	mk2_stat_inc(dev, write_submitted);
+	return 0;
+
+error:
+	__mk2_put_write_slot(endpoint, slot);
+	return retval;
+}
+
+/*
+ * Submits the coalescing slot, if there is one. Writers that stuffed into it
+ * have already returned, so a failure is reported by the next write.
+ * Must be called with slots_lock held.
+ */
+static void mk2_flush_pending(struct mk2_write_endp *endpoint)
+{
+	struct mk2_write_slot *slot = endpoint->pending;
+	int retval;
+
+	if (!slot)
+		return;
+
+	endpoint->pending = NULL;
+
+	retval = mk2_submit_write_slot(endpoint, slot);
+	if (retval < 0 && retval != -ENODEV) {
+		spin_lock(&endpoint->err_lock);
+		endpoint->errors = retval;
+		spin_unlock(&endpoint->err_lock);
+	}
+}
+
+/*
+ * Detaches the coalescing slot if a message of stuffed_size still fits in it.
+ * A slot that cannot take the message is submitted right away, so messages
+ * stay in order. Returns NULL when the caller needs a fresh slot.
+ */
+static struct mk2_write_slot *mk2_take_pending(struct mk2_write_endp *endpoint, size_t stuffed_size)
+{
+	struct mk2_write_slot *slot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+	slot = endpoint->pending;
+	if (slot && slot->len + stuffed_size <= MK2_WRITE_SLOT_SIZE) {
+		endpoint->pending = NULL;
+	} else {
+		mk2_flush_pending(endpoint);
+		slot = NULL;
+	}
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+
+	return slot;
+}
+
+/*
+ * Hands a filled slot over to the device. It is submitted immediately when
+ * the pipe is idle, when it can't take another message or when its
+ * coalescing deadline has passed. Otherwise it becomes the pending slot and
+ * goes out with the next write completion or when coalesce_timer fires.
+ */
+static int mk2_queue_write_slot(struct mk2_write_endp *endpoint, struct mk2_write_slot *slot, bool fresh)
+{
+	unsigned long flags;
+	ktime_t now;
+	int retval = 0;
+
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+
+	now = ktime_get();
+	if (fresh)
+		slot->deadline = ktime_add_us(now, coalesce_us);
+
+	if (endpoint->in_flight == 0 ||
+	    slot->len + MK2_STUFFED_PACKET_SIZE > MK2_WRITE_SLOT_SIZE ||
+	    !ktime_before(now, slot->deadline)) {
+		retval = mk2_submit_write_slot(endpoint, slot);
+	} else {
+		endpoint->pending = slot;
+		if (fresh)
+			hrtimer_start(&endpoint->coalesce_timer, slot->deadline,
+				      HRTIMER_MODE_ABS_SOFT);
+	}
+
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+
+	return retval;
+}
+
+/*
+ * Tells whether a new urb would have to wait behind more than one other.
+ */
+static bool mk2_write_congested(struct mk2_write_endp *endpoint)
+{
+	unsigned long flags;
+	bool congested;
+
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+	congested = endpoint->in_flight > 1;
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+
+	return congested;
+}
+
+static enum hrtimer_restart mk2_coalesce_timeout(struct hrtimer *timer)
+{
+	struct mk2_write_endp *endpoint;
+	unsigned long flags;
+
+	endpoint = container_of(timer, struct mk2_write_endp, coalesce_timer);
+
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+	mk2_flush_pending(endpoint);
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
 static void mk2_write_bulk_callback(struct urb *urb)
 {
+	struct mk2_write_slot *slot;
 	struct mk2dev *dev;
 	struct mk2_write_endp *endpoint;
 	unsigned long flags;
+	s64 latency;
 
-	dev = urb->context;
+	slot = urb->context;
+	dev = slot->dev;
 	endpoint = &dev->write_endp;
 
+	latency = ktime_to_ns(ktime_sub(ktime_get(), slot->submitted));
+	trace_mk2_write_complete(dev->interface->minor, urb->actual_length, urb->status,
+				 latency);
+
+	mk2_stat_inc(dev, write_completed);
+	mk2_stat_inc(dev, write_latency[mk2_hist_bucket(latency)]);
+	if (urb->status)
+		mk2_stat_inc(dev, write_status[mk2_stat_status(urb->status)]);
+
 	if (urb->status) {
 		if (!(urb->status == -ENOENT ||
 			urb->status == -ECONNRESET ||
@@ -182,419 +852,2854 @@ static void mk2_write_bulk_callback(struct urb *urb)
 		spin_unlock_irqrestore(&endpoint->err_lock, flags);
 	}
 
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&endpoint->limit_sem);
+	spin_lock_irqsave(&endpoint->slots_lock, flags);
+	--endpoint->in_flight;
+	++endpoint->complete_seq;
+	__mk2_put_write_slot(endpoint, slot);
+
+	// Pipe has room again, send whatever was collected in the meantime
+	mk2_flush_pending(endpoint);
+	spin_unlock_irqrestore(&endpoint->slots_lock, flags);
+
+	// Timed messages that found no free slot
+	mk2_timed_send(endpoint);
+
+	wake_up_interruptible(&endpoint->wait_queue);
+
+	// Latest wins frame was held back until the pipe drains, paced frames
+	// wait for the vblank instead
+	if (READ_ONCE(dev->fb.dirty) && !READ_ONCE(dev->fb.vblank_ns))
+		schedule_work(&dev->fb.work);
+}
+
+static inline u32 load3(const char *p)
+{
+	return (u8)p[0] | (u8)p[1] << 8 | (u8)p[2] << 16;
+}
+
+/*
+ * Packs payload into USB-MIDI sysex packets. When last is false the payload
+ * is a middle part of a longer message, its size must be a multiple of
+ * MK2_SYSEX_PACKET_SIZE and no end-of-sysex packet is emitted.
+ *
+ * Each packet is built in a register and written with a single store.
+ */
+VISIBLE_IF_KUNIT void mk2_stuff_buffer(char *buf, const char *payload,
+				       size_t count, bool last)
+{
+	size_t oi = 0, ii = 0, tail;
+	u32 data;
+
+	// Wide load is fine as long as it doesn't reach past the payload
+	for (; ii + sizeof(u32) <= count; ii += 3, oi += 4)
+		put_unaligned_le32(MK2_SYSEX_MOREDATA |
+				   get_unaligned_le32(payload + ii) << 8, buf + oi);
+
+	for (; ii + 3 <= count; ii += 3, oi += 4)
+		put_unaligned_le32(MK2_SYSEX_MOREDATA | load3(payload + ii) << 8, buf + oi);
+
+	if (!last)
+		return;
+
+	/* Last packet carries 1 - 3 bytes and has code index number of
+	 * DATAEND1 - DATAEND3 respectively. When the payload is a whole number
+	 * of packets, it replaces the last MOREDATA one. Its bytes are taken
+	 * from the last three bytes of the payload, shifting out those that
+	 * belong to the previous packet, which also zeroes the padding.
+	 */
+	tail = (count - 1) % 3 + 1;
+
+	if (count >= 3)
+		data = load3(payload + count - 3) >> (8 * (3 - tail));
+	else
+		data = (u8)payload[0] | (count > 1 ? (u8)payload[1] << 8 : 0);
+
+	put_unaligned_le32((MK2_SYSEX_DATAEND1 + tail - 1) | data << 8,
+			   buf + (count - tail) / 3 * 4);
+}
+EXPORT_SYMBOL_IF_KUNIT(mk2_stuff_buffer);
+
+/*
+ * Stuffs user's payload straight into the urb buffer. Data is pulled from
+ * userspace in small chunks through an on-stack staging block, so the write
+ * path neither allocates nor copies the whole payload twice. Same as with
+ * mk2_stuff_buffer, last tells whether the payload ends the message.
+ */
+static int stuff_user_buffer(char *buf, const char __user *user_buffer, size_t count, bool last)
+{
+	char chunk[MK2_STUFF_CHUNK_SIZE];
+	size_t done = 0, n;
+
+	while (done < count) {
+		n = min(count - done, sizeof(chunk));
+
+		if (copy_from_user(chunk, user_buffer + done, n))
+			return -EFAULT;
+
+		mk2_stuff_buffer(buf + done / MK2_SYSEX_PACKET_SIZE * MK2_STUFFED_PACKET_SIZE,
+				 chunk, n, last && done + n == count);
+		done += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Computes size of the buffer with necessary metadata that wraps user's payload
+ */
+static size_t compute_stuffed_size(size_t payload_size)
+{
+	size_t stuffed_size;
+
+	/* Each packet in sysex message must be padded to max width ie. 4.
+	 * Thats why we round data size up first.
+	 * */
+	stuffed_size  = payload_size + MK2_SYSEX_SIZE_ROUND_UP;
+
+	/* Calculate number of packets */
+	stuffed_size /= MK2_SYSEX_PACKET_SIZE;
+
+	/* Get total data size with stuffed bytes between packets */
+	stuffed_size *= MK2_STUFFED_PACKET_SIZE;
+
+	return stuffed_size;
 }
 
-static void stuff_buffer(char *buf, size_t stuffed_size, const char __user *user_buffer, size_t count)
+/*
+ * Returns and clears the error recorded by write completions, mapped to what
+ * the writer should see.
+ */
+static int mk2_write_take_error(struct mk2_write_endp *endpoint)
+{
+	int retval;
+
+	spin_lock_irq(&endpoint->err_lock);
+	retval = endpoint->errors;
+	if (retval < 0) {
+		endpoint->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&endpoint->err_lock);
+
+	return retval;
+}
+
+/*
+ * Waits until every urb submitted so far has completed, sending the
+ * coalescing slot right away. Bulk urbs complete in order, so it's enough
+ * to wait for the completion count to catch up. Returns 0 or error recorded
+ * by the completions, -ETIMEDOUT when timeout (in jiffies) runs out first.
+ */
+static int mk2_write_barrier(struct mk2dev *dev, long timeout)
+{
+	struct mk2_write_endp *endpoint = &dev->write_endp;
+	unsigned int target;
+	long retval;
+
+	spin_lock_irq(&endpoint->slots_lock);
+	mk2_flush_pending(endpoint);
+	target = endpoint->submit_seq;
+	spin_unlock_irq(&endpoint->slots_lock);
+
+	retval = wait_event_interruptible_timeout(endpoint->wait_queue,
+			(int)(READ_ONCE(endpoint->complete_seq) - target) >= 0 ||
+			dev->state.disconnected,
+			timeout);
+	if (retval < 0)
+		return retval;
+
+	if (dev->state.disconnected)
+		return -ENODEV;
+
+	if (retval == 0)
+		return -ETIMEDOUT;
+
+	return mk2_write_take_error(endpoint);
+}
+
+/*
+ * Submits timed messages that are due and arms the timer for the next one.
+ * A due message that finds no free slot, or a write split over several urbs
+ * on its way out, waits for the next write completion or for the split write
+ * to finish, both of which call here again. Reaction responses may also take
+ * the priority slot, plain timed messages never do, so queueing many of them
+ * can't hold priority writers up. Called from any context.
+ */
+static void mk2_timed_send(struct mk2_write_endp *endpoint)
+{
+	struct mk2dev *dev = container_of(endpoint, struct mk2dev, write_endp);
+	struct mk2_timed_msg *msg;
+	struct mk2_write_slot *slot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&endpoint->timed_lock, flags);
+
+	while (!list_empty(&endpoint->timed) && !dev->state.disconnected) {
+		msg = list_first_entry(&endpoint->timed, struct mk2_timed_msg, node);
+
+		if (ktime_after(msg->time, ktime_get())) {
+			hrtimer_start(&endpoint->timed_timer, msg->time, HRTIMER_MODE_ABS_SOFT);
+			break;
+		}
+
+		if (!down_trylock(&endpoint->limit_sem))
+			slot = mk2_get_write_slot(endpoint);
+		else if (msg->reaction && !down_trylock(&endpoint->prio_sem))
+			slot = endpoint->prio_slot;
+		else
+			break;
+
+		mk2_stuff_buffer(slot->buf, msg->data, msg->len, true);
+		slot->len = compute_stuffed_size(msg->len);
+
+		spin_lock(&endpoint->slots_lock);
+		if (endpoint->split) {
+			__mk2_put_write_slot(endpoint, slot);
+			spin_unlock(&endpoint->slots_lock);
+			break;
+		}
+
+		// Whatever waits for coalescing was queued first, it goes out first
+		mk2_flush_pending(endpoint);
+		mk2_submit_write_slot(endpoint, slot);
+		spin_unlock(&endpoint->slots_lock);
+
+		mk2_stat_add(dev, write_payload_bytes, msg->len);
+		mk2_stat_add(dev, write_stuffed_bytes, compute_stuffed_size(msg->len));
+
+		list_del(&msg->node);
+		--endpoint->nr_timed;
+		kfree(msg);
+	}
+
+	spin_unlock_irqrestore(&endpoint->timed_lock, flags);
+}
+
+static enum hrtimer_restart mk2_timed_expire(struct hrtimer *timer)
+{
+	struct mk2_write_endp *endpoint = container_of(timer, struct mk2_write_endp, timed_timer);
+
+	mk2_timed_send(endpoint);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Queues msg and sends whatever is due. Takes ownership of msg, also when it
+ * fails. Can be called from any context.
+ */
+static int mk2_timed_queue(struct mk2dev *dev, struct mk2_timed_msg *msg)
+{
+	struct mk2_write_endp *endpoint = &dev->write_endp;
+	struct mk2_timed_msg *pos;
+	unsigned long flags;
+	int retval = 0;
+
+	spin_lock_irqsave(&endpoint->timed_lock, flags);
+
+	if (dev->state.disconnected) {
+		retval = -ENODEV;
+	} else if (endpoint->nr_timed >= MK2_MAX_TIMED_MSGS) {
+		retval = -ENOSPC;
+	} else {
+		// Messages usually come in time order, look from the back
+		list_for_each_entry_reverse(pos, &endpoint->timed, node)
+			if (!ktime_after(pos->time, msg->time))
+				break;
+		list_add(&msg->node, &pos->node);
+		++endpoint->nr_timed;
+	}
+
+	spin_unlock_irqrestore(&endpoint->timed_lock, flags);
+
+	if (retval < 0) {
+		kfree(msg);
+		return retval;
+	}
+
+	// Rearms the timer, in case the message became the first one
+	mk2_timed_send(endpoint);
+
+	return 0;
+}
+
+static long mk2_ioctl_queue_timed(struct mk2dev *dev, void __user *arg)
+{
+	struct mk2_timed_message req;
+	struct mk2_timed_msg *msg;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.reserved || req.len == 0)
+		return -EINVAL;
+
+	// Must go out in a single urb, timed messages are never split
+	if (req.len > MK2_WRITE_SLOT_PAYLOAD)
+		return -EMSGSIZE;
+
+	msg = kmalloc(struct_size(msg, data, req.len), GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	if (copy_from_user(msg->data, u64_to_user_ptr(req.data), req.len)) {
+		kfree(msg);
+		return -EFAULT;
+	}
+
+	msg->time = ns_to_ktime(req.time);
+	msg->len = req.len;
+	msg->reaction = false;
+
+	return mk2_timed_queue(dev, msg);
+}
+
+/*
+ * Drops every timed message not sent yet. Must not race with
+ * mk2_timed_send, that is called either with timed_lock held or once
+ * nothing can send anymore.
+ */
+static void __mk2_timed_clear(struct mk2_write_endp *endpoint)
+{
+	struct mk2_timed_msg *msg, *tmp;
+
+	list_for_each_entry_safe(msg, tmp, &endpoint->timed, node) {
+		list_del(&msg->node);
+		kfree(msg);
+	}
+
+	endpoint->nr_timed = 0;
+}
+
+static void mk2_timed_clear(struct mk2_write_endp *endpoint)
+{
+	spin_lock_irq(&endpoint->timed_lock);
+	__mk2_timed_clear(endpoint);
+	spin_unlock_irq(&endpoint->timed_lock);
+
+	hrtimer_try_to_cancel(&endpoint->timed_timer);
+}
+
+/*
+ * Size count bytes of a message take in the urb buffer.
+ */
+static size_t mk2_write_size(size_t count, bool last, unsigned int flags)
+{
+	if (flags & MK2_WRITE_STUFFED)
+		return count;
+
+	return last ? compute_stuffed_size(count)
+		    : count / MK2_SYSEX_PACKET_SIZE * MK2_STUFFED_PACKET_SIZE;
+}
+
+static int mk2_write_stuff(struct mk2_write_slot *slot, const char __user *user_buffer,
+			   const char *buffer, size_t count, bool last, unsigned int flags)
+{
+	if (flags & MK2_WRITE_STUFFED) {
+		memcpy(slot->buf + slot->len, buffer, count);
+		return 0;
+	}
+
+	if (user_buffer)
+		return stuff_user_buffer(slot->buf + slot->len, user_buffer, count, last);
+
+	mk2_stuff_buffer(slot->buf + slot->len, buffer, count, last);
+	return 0;
+}
+
+/*
+ * Sends a message on the priority lane. It neither waits behind the
+ * coalescing slot nor queues on limit_sem with other writers, and when every
+ * regular slot is in flight it goes out in the reserved prio_slot. The
+ * message has to fit one urb. Only a write split over several urbs, which
+ * must stay contiguous on the wire, holds it back.
+ */
+static ssize_t mk2_write_priority(struct mk2dev *dev, const char __user *user_buffer,
+				  const char *buffer, size_t count, unsigned int flags)
+{
+	struct mk2_write_endp *endpoint = &dev->write_endp;
+	bool nonblock = flags & MK2_WRITE_NONBLOCK;
+	struct mk2_write_slot *slot;
+	ssize_t retval;
+
+	if (mk2_write_size(count, true, flags) > MK2_WRITE_SLOT_SIZE)
+		return -EMSGSIZE;
+
+	if (!nonblock) {
+		if (mutex_lock_interruptible(&endpoint->prio_mutex))
+			return -ERESTARTSYS;
+	} else {
+		if (!mutex_trylock(&endpoint->prio_mutex))
+			return -EAGAIN;
+	}
+
+	if (unlikely(dev->state.disconnected)) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	retval = mk2_write_take_error(endpoint);
+	if (retval < 0)
+		goto unlock;
+
+	if (!down_trylock(&endpoint->limit_sem)) {
+		slot = mk2_get_write_slot(endpoint);
+	} else {
+		if (!nonblock) {
+			if (down_interruptible(&endpoint->prio_sem)) {
+				retval = -ERESTARTSYS;
+				goto unlock;
+			}
+		} else {
+			if (down_trylock(&endpoint->prio_sem)) {
+				retval = -EAGAIN;
+				goto unlock;
+			}
+		}
+
+		slot = endpoint->prio_slot;
+		slot->len = 0;
+	}
+
+	retval = mk2_write_stuff(slot, user_buffer, buffer, count, true, flags);
+	if (retval < 0) {
+		mk2_put_write_slot(endpoint, slot);
+		goto unlock;
+	}
+	slot->len = mk2_write_size(count, true, flags);
+	mk2_stat_add(dev, write_payload_bytes, count);
+	mk2_stat_add(dev, write_stuffed_bytes, slot->len);
+
+	for (;;) {
+		spin_lock_irq(&endpoint->slots_lock);
+		if (!endpoint->split)
+			break;
+		spin_unlock_irq(&endpoint->slots_lock);
+
+		if (dev->state.disconnected) {
+			retval = -ENODEV;
+		} else if (nonblock) {
+			retval = -EAGAIN;
+		} else {
+			retval = wait_event_interruptible(endpoint->wait_queue,
+					!READ_ONCE(endpoint->split) ||
+					dev->state.disconnected);
+		}
+
+		if (retval < 0) {
+			mk2_put_write_slot(endpoint, slot);
+			goto unlock;
+		}
+	}
+
+	// Goes ahead of the coalescing slot, which keeps waiting for its
+	// deadline or the next completion
+	retval = mk2_submit_write_slot(endpoint, slot);
+	spin_unlock_irq(&endpoint->slots_lock);
+
+	if (retval == 0)
+		retval = count;
+
+unlock:
+	mutex_unlock(&endpoint->prio_mutex);
+	return retval;
+}
+
+/*
+ * Queues one sysex message for the device. The payload comes either from
+ * userspace (user_buffer) or from the driver itself (buffer), exactly one of
+ * them has to be set.
+ *
+ * Messages larger than a write slot are split into several urbs, which are
+ * submitted back to back as slots become free. Once the first part is
+ * queued the rest follows regardless of O_NONBLOCK or signals, an open sysex
+ * would swallow whatever other output comes next. Returns number of payload
+ * bytes queued, less than count only when the task is being killed or the
+ * payload faults halfway.
+ *
+ * With MK2_WRITE_PRIORITY the message goes through mk2_write_priority.
+ * With MK2_WRITE_STUFFED buffer is copied into a single urb as it is.
+ */
+static ssize_t mk2_write_message(struct mk2dev *dev, const char __user *user_buffer,
+				 const char *buffer, size_t count, unsigned int flags)
+{
+	struct mk2_write_endp *endpoint;
+	struct mk2_write_slot *slot;
+	ssize_t retval;
+	size_t done = 0, n, stuffed_size, offset;
+	ktime_t blocked;
+	bool nonblock = flags & MK2_WRITE_NONBLOCK;
+	bool last;
+
+	if (flags & MK2_WRITE_PRIORITY)
+		return mk2_write_priority(dev, user_buffer, buffer, count, flags);
+
+	endpoint = &dev->write_endp;
+
+	// Writers are serialized, so that messages keep their order on the wire
+	if (!nonblock) {
+		if (mutex_lock_interruptible(&endpoint->io_mutex))
+			return -ERESTARTSYS;
+	} else {
+		if (!mutex_trylock(&endpoint->io_mutex))
+			return -EAGAIN;
+	}
+
+	if (unlikely(dev->state.disconnected)) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	retval = mk2_write_take_error(endpoint);
+	if (retval < 0)
+		goto unlock;
+
+	while (done < count) {
+		n = min(count - done, (flags & MK2_WRITE_STUFFED) ? MK2_WRITE_SLOT_SIZE
+								  : MK2_WRITE_SLOT_PAYLOAD);
+		last = done + n == count;
+		stuffed_size = mk2_write_size(n, last, flags);
+
+		// Short messages ride along in the slot that waits for the pipe
+		slot = mk2_take_pending(endpoint, stuffed_size);
+		if (!slot) {
+			if (down_trylock(&endpoint->limit_sem)) {
+				if (nonblock && !done) {
+					retval = -EAGAIN;
+					break;
+				}
+
+				// A started message has to be finished
+				blocked = ktime_get();
+				retval = done ? down_killable(&endpoint->limit_sem)
+					      : down_interruptible(&endpoint->limit_sem);
+				mk2_stat_add(dev, write_blocked_ns,
+					     ktime_to_ns(ktime_sub(ktime_get(), blocked)));
+				if (retval) {
+					retval = -ERESTARTSYS;
+					break;
+				}
+			}
+
+			slot = mk2_get_write_slot(endpoint);
+		}
+
+		offset = slot->len;
+		retval = mk2_write_stuff(slot, user_buffer ? user_buffer + done : NULL,
+					 buffer ? buffer + done : NULL, n, last, flags);
+		if (retval < 0) {
+			// Messages stuffed by earlier writers still have to go out
+			if (offset)
+				mk2_queue_write_slot(endpoint, slot, false);
+			else
+				mk2_put_write_slot(endpoint, slot);
+			break;
+		}
+		slot->len += stuffed_size;
+		mk2_stat_add(dev, write_payload_bytes, n);
+		mk2_stat_add(dev, write_stuffed_bytes, stuffed_size);
+
+		if (static_branch_unlikely(&mk2_hexdump))
+			print_hex_dump(KERN_DEBUG, "mk2 write: ", DUMP_PREFIX_ADDRESS,
+				       16, 1, slot->buf + offset, stuffed_size, true);
+
+		// Keep priority messages out until the last part is queued
+		if (!last)
+			WRITE_ONCE(endpoint->split, true);
+
+		retval = mk2_queue_write_slot(endpoint, slot, offset == 0);
+		if (retval < 0)
+			break;
+
+		done += n;
+	}
+
+	// A write cut short by a fatal signal or a fault leaves its message
+	// open, priority messages are not held back for that long
+	if (endpoint->split) {
+		WRITE_ONCE(endpoint->split, false);
+		wake_up_interruptible(&endpoint->wait_queue);
+		mk2_timed_send(endpoint);
+	}
+
+	if (done)
+		retval = done;
+
+unlock:
+	mutex_unlock(&endpoint->io_mutex);
+	return retval;
+}
+
+/*
+ * Hands the device to the queued file with the earliest finish tag. Must be
+ * called with sched_lock held and no owner.
+ */
+static void mk2_sched_next(struct mk2_write_endp *endpoint)
+{
+	struct mk2_write_ctx *ctx;
+
+	if (list_empty(&endpoint->sched_queue))
+		return;
+
+	ctx = list_first_entry(&endpoint->sched_queue, struct mk2_write_ctx, node);
+	list_del_init(&ctx->node);
+
+	endpoint->sched_owner = ctx;
+	endpoint->sched_vtime = ctx->finish;
+	wake_up_all(&endpoint->sched_wait);
+}
+
+/*
+ * Waits until it is ctx's turn to write count bytes. Writes are ordered by
+ * self-clocked fair queueing: each one gets a finish tag of its file's
+ * previous tag, or the current virtual time if the file was idle, plus its
+ * size divided by the file's weight. Files flooding the device run ahead of
+ * the virtual time and fall behind everyone else's writes, while a file
+ * that writes after a pause goes next.
+ */
+static int mk2_sched_enter(struct mk2dev *dev, struct mk2_write_ctx *ctx,
+			   size_t count, bool nonblock)
+{
+	struct mk2_write_endp *endpoint = &dev->write_endp;
+	struct mk2_write_ctx *pos;
+	int retval;
+
+	if (!nonblock) {
+		if (mutex_lock_interruptible(&ctx->mutex))
+			return -ERESTARTSYS;
+	} else {
+		if (!mutex_trylock(&ctx->mutex))
+			return -EAGAIN;
+	}
+
+	spin_lock(&endpoint->sched_lock);
+
+	if (!endpoint->sched_owner && list_empty(&endpoint->sched_queue)) {
+		ctx->finish = max(ctx->finish, endpoint->sched_vtime) +
+			      div_u64(count * MK2_MAX_WRITE_WEIGHT, ctx->weight);
+		endpoint->sched_owner = ctx;
+		endpoint->sched_vtime = ctx->finish;
+		spin_unlock(&endpoint->sched_lock);
+		return 0;
+	}
+
+	if (nonblock) {
+		spin_unlock(&endpoint->sched_lock);
+		retval = -EAGAIN;
+		goto error;
+	}
+
+	ctx->finish = max(ctx->finish, endpoint->sched_vtime) +
+		      div_u64(count * MK2_MAX_WRITE_WEIGHT, ctx->weight);
+
+	list_for_each_entry(pos, &endpoint->sched_queue, node)
+		if (pos->finish > ctx->finish)
+			break;
+	list_add_tail(&ctx->node, &pos->node);
+
+	spin_unlock(&endpoint->sched_lock);
+
+	retval = wait_event_interruptible(endpoint->sched_wait,
+			READ_ONCE(endpoint->sched_owner) == ctx ||
+			dev->state.disconnected);
+
+	spin_lock(&endpoint->sched_lock);
+	if (endpoint->sched_owner == ctx) {
+		spin_unlock(&endpoint->sched_lock);
+		return 0;
+	}
+	list_del_init(&ctx->node);
+	spin_unlock(&endpoint->sched_lock);
+
+	if (retval == 0)
+		retval = -ENODEV;
+
+error:
+	mutex_unlock(&ctx->mutex);
+	return retval;
+}
+
+static void mk2_sched_exit(struct mk2dev *dev, struct mk2_write_ctx *ctx)
+{
+	struct mk2_write_endp *endpoint = &dev->write_endp;
+
+	spin_lock(&endpoint->sched_lock);
+	endpoint->sched_owner = NULL;
+	mk2_sched_next(endpoint);
+	spin_unlock(&endpoint->sched_lock);
+
+	mutex_unlock(&ctx->mutex);
+
+	// Nonblocking writers poll for the device to be free again
+	wake_up_interruptible(&endpoint->wait_queue);
+}
+
+static int mk2_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+	struct mk2_file *mfile = filp->private_data;
+
+	return mk2_write_barrier(mfile->dev, MAX_SCHEDULE_TIMEOUT);
+}
+
+static int mk2_flush(struct file *filp, fl_owner_t id)
+{
+	struct mk2_file *mfile = filp->private_data;
+	int retval;
+
+	retval = mk2_write_barrier(mfile->dev, msecs_to_jiffies(MK2_FLUSH_TIMEOUT_MS));
+
+	// Device going away or a slow pipe is no reason to fail close
+	if (retval == -ENODEV || retval == -ETIMEDOUT || retval == -ERESTARTSYS)
+		retval = 0;
+
+	return retval;
+}
+
+static unsigned int mk2_write_flags(struct file *filp)
+{
+	struct mk2_file *mfile = filp->private_data;
+	unsigned int flags = 0;
+
+	if (filp->f_flags & O_NONBLOCK)
+		flags |= MK2_WRITE_NONBLOCK;
+	if (READ_ONCE(mfile->flags) & MK2_FLAG_PRIORITY)
+		flags |= MK2_WRITE_PRIORITY;
+
+	return flags;
+}
+
+static ssize_t mk2_write(struct file *filp, const char __user *user_buffer, size_t count, loff_t *ppos)
+{
+	struct mk2_file *mfile;
+	unsigned int flags;
+	ssize_t retval;
+
+	if (count == 0)
+		return 0;
+
+	if (unlikely(!access_ok(user_buffer, count)))
+		return -EINVAL;
+
+	mfile = filp->private_data;
+	flags = mk2_write_flags(filp);
+
+	if (flags & MK2_WRITE_PRIORITY)
+		return mk2_write_message(mfile->dev, user_buffer, NULL, count, flags);
+
+	retval = mk2_sched_enter(mfile->dev, &mfile->write_ctx, count,
+				 flags & MK2_WRITE_NONBLOCK);
+	if (retval < 0)
+		return retval;
+
+	retval = mk2_write_message(mfile->dev, user_buffer, NULL, count, flags);
+	mk2_sched_exit(mfile->dev, &mfile->write_ctx);
+
+	return retval;
+}
+
+static u8 mk2_led_id(unsigned int index)
+{
+	if (index < MK2_GRID_LED_COUNT)
+		return (index / 9 + 1) * 10 + index % 9 + 1;
+
+	return MK2_TOP_ROW_FIRST_LED + index - MK2_GRID_LED_COUNT;
+}
+
+/*
+ * Inverse of mk2_led_id, returns -1 for ids that are not a button.
+ */
+static int mk2_led_index(u8 id)
+{
+	unsigned int row = id / 10, col = id % 10;
+
+	if (row >= 1 && row <= 8 && col >= 1 && col <= 9)
+		return (row - 1) * 9 + col - 1;
+
+	if (id >= MK2_TOP_ROW_FIRST_LED &&
+	    id < MK2_TOP_ROW_FIRST_LED + MK2_LED_COUNT - MK2_GRID_LED_COUNT)
+		return MK2_GRID_LED_COUNT + id - MK2_TOP_ROW_FIRST_LED;
+
+	return -1;
+}
+
+/*
+ * Returns palette colour the LED can be sent as, or -1 when it needs an rgb
+ * entry. Black is palette colour 0, which saves 3 bytes per LED turned off.
+ */
+static int mk2_led_palette(const struct mk2_led *led)
+{
+	if (led->palette)
+		return led->palette;
+
+	if (!led->red && !led->green && !led->blue)
+		return 0;
+
+	return -1;
+}
+
+static bool mk2_led_valid(const struct mk2_led *led)
+{
+	return led->red <= MK2_RGB_MAX && led->green <= MK2_RGB_MAX &&
+	       led->blue <= MK2_RGB_MAX && led->palette <= MK2_PALETTE_MAX;
+}
+
+/*
+ * Scrolled text may only hold 7 bit characters, 1 - 7 change the speed.
+ */
+static bool mk2_text_invalid(const u8 *text, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		if (!text[i] || text[i] & 0x80)
+			return true;
+
+	return false;
+}
+
+static bool mk2_frame_valid(const struct mk2_frame *frame)
+{
+	unsigned int i;
+
+	for (i = 0; i < MK2_LED_COUNT; ++i)
+		if (!mk2_led_valid(&frame->leds[i]))
+			return false;
+
+	return true;
+}
+
+static struct mk2_frame *mk2_fb_page(struct mk2_fb *fb, unsigned int index)
+{
+	return fb->pages + index * PAGE_SIZE;
+}
+
+/*
+ * Builds one light LED message (palette or rgb) into fb->msg from the changed
+ * LEDs starting at *pos. Advances *pos past the last LED that made it into
+ * the message. Returns message size, 0 if there was nothing to send.
+ */
+static size_t mk2_fb_build(struct mk2_fb *fb, const unsigned long *changed,
+			   unsigned int *pos, bool palette)
+{
+	const size_t entry_size = palette ? 2 : 4;
+	char *p = fb->msg;
+	unsigned int i;
+	int colour;
+
+	memcpy(p, mk2_sysex_header, sizeof(mk2_sysex_header));
+	p += sizeof(mk2_sysex_header);
+	*p++ = palette ? MK2_CMD_LED_PALETTE : MK2_CMD_LED_RGB;
+
+	for (i = *pos; i < MK2_LED_COUNT; ++i) {
+		const struct mk2_led *led = &fb->next.leds[i];
+
+		if (!test_bit(i, changed))
+			continue;
+
+		colour = mk2_led_palette(led);
+		if ((colour >= 0) != palette)
+			continue;
+
+		// Keep room for the entry and the end of sysex
+		if (p + entry_size + 1 - fb->msg > sizeof(fb->msg))
+			break;
+
+		*p++ = mk2_led_id(i);
+		if (palette) {
+			*p++ = colour;
+		} else {
+			*p++ = led->red;
+			*p++ = led->green;
+			*p++ = led->blue;
+		}
+	}
+
+	*pos = i;
+
+	if (p - fb->msg == sizeof(mk2_sysex_header) + 1)
+		return 0;
+
+	*p++ = MK2_SYSEX_END;
+	return p - fb->msg;
+}
+
+/*
+ * Takes the overridden marks of leds, recording the ones taken in claimed,
+ * so that a reaction landing while the message is on its way marks the LED
+ * again. Marks are handed back with mk2_fb_unclaim when the message fails.
+ */
+static void mk2_fb_claim(struct mk2_fb *fb, unsigned long *claimed, const unsigned long *leds)
+{
+	unsigned int i;
+
+	bitmap_zero(claimed, MK2_LED_COUNT);
+	for_each_set_bit(i, leds, MK2_LED_COUNT)
+		if (test_and_clear_bit(i, fb->overridden))
+			__set_bit(i, claimed);
+}
+
+static void mk2_fb_unclaim(struct mk2_fb *fb, const unsigned long *claimed)
+{
+	unsigned int i;
+
+	for_each_set_bit(i, claimed, MK2_LED_COUNT)
+		set_bit(i, fb->overridden);
+}
+
+/*
+ * Sends LEDs of one kind that differ between fb->next and fb->shadow, and
+ * records them in shadow once they are queued.
+ */
+static int mk2_fb_send_changed(struct mk2dev *dev, const unsigned long *changed,
+			       bool palette, unsigned int flags)
+{
+	struct mk2_fb *fb = &dev->fb;
+	DECLARE_BITMAP(sent, MK2_LED_COUNT);
+	DECLARE_BITMAP(claimed, MK2_LED_COUNT);
+	unsigned int pos = 0, start, i;
+	ssize_t retval;
+	size_t len;
+
+	while (pos < MK2_LED_COUNT) {
+		start = pos;
+		len = mk2_fb_build(fb, changed, &pos, palette);
+		if (!len)
+			break;
+
+		bitmap_zero(sent, MK2_LED_COUNT);
+		for (i = start; i < pos; ++i)
+			if (test_bit(i, changed) &&
+			    (mk2_led_palette(&fb->next.leds[i]) >= 0) == palette)
+				__set_bit(i, sent);
+
+		mk2_fb_claim(fb, claimed, sent);
+		retval = mk2_write_message(dev, NULL, fb->msg, len, flags);
+		if (retval < 0) {
+			mk2_fb_unclaim(fb, claimed);
+			return retval;
+		}
+
+		for_each_set_bit(i, sent, MK2_LED_COUNT)
+			fb->shadow.leds[i] = fb->next.leds[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Makes the device display fb->next using as few bytes as possible. LEDs
+ * which can be expressed by a palette index go out as 2 byte entries, the
+ * rest as 4 byte rgb entries, and a frame of a single palette colour
+ * collapses into one light all message. Must be called with fb->lock held.
+ */
+static int mk2_fb_commit(struct mk2dev *dev, unsigned int flags)
+{
+	struct mk2_fb *fb = &dev->fb;
+	DECLARE_BITMAP(changed, MK2_LED_COUNT);
+	DECLARE_BITMAP(claimed, MK2_LED_COUNT);
+	unsigned int i, nchanged = 0;
+	bool uniform = true;
+	int colour, retval;
+	ssize_t sent;
+
+	bitmap_zero(changed, MK2_LED_COUNT);
+
+	colour = mk2_led_palette(&fb->next.leds[0]);
+	for (i = 0; i < MK2_LED_COUNT; ++i) {
+		const struct mk2_led *led = &fb->next.leds[i];
+
+		if (mk2_led_palette(led) != colour)
+			uniform = false;
+
+		if (fb->valid && !test_bit(i, fb->overridden) &&
+		    !memcmp(led, &fb->shadow.leds[i], sizeof(*led)))
+			continue;
+
+		__set_bit(i, changed);
+		++nchanged;
+	}
+
+	if (!nchanged)
+		return 0;
+
+	if (uniform && colour >= 0) {
+		char *p = fb->msg;
+
+		memcpy(p, mk2_sysex_header, sizeof(mk2_sysex_header));
+		p += sizeof(mk2_sysex_header);
+		*p++ = MK2_CMD_ALL_PALETTE;
+		*p++ = colour;
+		*p++ = MK2_SYSEX_END;
+
+		mk2_fb_claim(fb, claimed, changed);
+		sent = mk2_write_message(dev, NULL, fb->msg, p - fb->msg, flags);
+		if (sent < 0) {
+			mk2_fb_unclaim(fb, claimed);
+			return sent;
+		}
+
+		fb->shadow = fb->next;
+		fb->valid = true;
+		return 0;
+	}
+
+	retval = mk2_fb_send_changed(dev, changed, true, flags);
+	if (retval < 0)
+		return retval;
+
+	retval = mk2_fb_send_changed(dev, changed, false, flags);
+	if (retval < 0)
+		return retval;
+
+	fb->valid = true;
+	return 0;
+}
+
+/*
+ * Sends the dirty fb->next. In latest wins mode the frame goes out only
+ * while at most one write urb is in flight. Otherwise it is left dirty for
+ * mk2_fb_work, which runs after the next write completion, and any frame
+ * committed meanwhile simply replaces it. Must be called with fb->lock held.
+ */
+static int mk2_fb_flush(struct mk2dev *dev, bool latest_wins, unsigned int flags)
+{
+	struct mk2_fb *fb = &dev->fb;
+	int retval;
+
+	if (latest_wins) {
+		if (mk2_write_congested(&dev->write_endp))
+			return 0;
+
+		flags |= MK2_WRITE_NONBLOCK;
+	}
+
+	retval = mk2_fb_commit(dev, flags);
+	if (retval == 0)
+		fb->dirty = false;
+	else if (latest_wins && retval == -EAGAIN)
+		retval = 0;
+
+	return retval;
+}
+
+/*
+ * Displays fb->next, right away or on the next vblank when the refresh rate
+ * is set. Must be called with fb->lock held.
+ */
+static int mk2_fb_update(struct mk2dev *dev, bool latest_wins, unsigned int flags)
+{
+	struct mk2_fb *fb = &dev->fb;
+
+	fb->dirty = true;
+	fb->priority = flags & MK2_WRITE_PRIORITY;
+
+	if (fb->vblank_ns)
+		return 0;
+
+	return mk2_fb_flush(dev, latest_wins, flags);
+}
+
+static void mk2_fb_work(struct work_struct *work)
+{
+	struct mk2dev *dev = container_of(work, struct mk2dev, fb.work);
+	struct mk2_fb *fb = &dev->fb;
+
+	mutex_lock(&fb->lock);
+	if (fb->dirty)
+		mk2_fb_flush(dev, true, fb->priority ? MK2_WRITE_PRIORITY : 0);
+	mutex_unlock(&fb->lock);
+}
+
+/*
+ * Sends whatever changed since the previous vblank, so any number of
+ * updates in between costs a single frame. A frame that doesn't fit into
+ * the pipe waits for the next vblank.
+ */
+static enum hrtimer_restart mk2_fb_vblank(struct hrtimer *timer)
+{
+	struct mk2dev *dev = container_of(timer, struct mk2dev, fb.vblank_timer);
+	struct mk2_fb *fb = &dev->fb;
+	unsigned long flags;
+	u64 period;
+
+	spin_lock_irqsave(&fb->vblank_lock, flags);
+	++fb->vblank_seq;
+	fb->vblank_time = ktime_get();
+	spin_unlock_irqrestore(&fb->vblank_lock, flags);
+	wake_up_all(&fb->vblank_wait);
+
+	if (READ_ONCE(fb->dirty))
+		schedule_work(&fb->work);
+
+	period = READ_ONCE(fb->vblank_ns);
+	if (!period)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(period));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Sets refresh rate in Hz, 0 sends every update right away again. Must be
+ * called with fb->lock held.
+ */
+static void mk2_fb_set_refresh_rate(struct mk2dev *dev, unsigned int rate)
+{
+	struct mk2_fb *fb = &dev->fb;
+	u64 period = rate ? div_u64(NSEC_PER_SEC, rate) : 0;
+	bool running = fb->vblank_ns;
+
+	WRITE_ONCE(fb->refresh_rate, rate);
+	WRITE_ONCE(fb->vblank_ns, period);
+
+	if (period && !running) {
+		hrtimer_start(&fb->vblank_timer, ns_to_ktime(period), HRTIMER_MODE_REL_SOFT);
+	} else if (!period && running) {
+		hrtimer_cancel(&fb->vblank_timer);
+		wake_up_all(&fb->vblank_wait);
+
+		if (fb->dirty)
+			schedule_work(&fb->work);
+	}
+}
+
+static long mk2_ioctl_wait_vblank(struct mk2dev *dev, void __user *arg)
+{
+	struct mk2_fb *fb = &dev->fb;
+	struct mk2_vblank vblank;
+	u64 seq;
+	long retval;
+
+	if (!READ_ONCE(fb->vblank_ns))
+		return -EINVAL;
+
+	spin_lock_irq(&fb->vblank_lock);
+	seq = fb->vblank_seq;
+	spin_unlock_irq(&fb->vblank_lock);
+
+	retval = wait_event_interruptible(fb->vblank_wait,
+			READ_ONCE(fb->vblank_seq) != seq ||
+			!READ_ONCE(fb->vblank_ns) ||
+			dev->state.disconnected);
+	if (retval < 0)
+		return retval;
+
+	if (dev->state.disconnected)
+		return -ENODEV;
+
+	spin_lock_irq(&fb->vblank_lock);
+	vblank.sequence = fb->vblank_seq;
+	vblank.timestamp = ktime_to_ns(fb->vblank_time);
+	spin_unlock_irq(&fb->vblank_lock);
+
+	// Refresh got disabled while waiting
+	if (vblank.sequence == seq)
+		return -EINVAL;
+
+	if (copy_to_user(arg, &vblank, sizeof(vblank)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long mk2_ioctl_commit_frame(struct mk2_file *mfile, void __user *arg, unsigned int flags)
+{
+	struct mk2dev *dev = mfile->dev;
+	struct mk2_fb *fb = &dev->fb;
+	long retval;
+
+	if (mutex_lock_interruptible(&fb->lock))
+		return -ERESTARTSYS;
+
+	if (copy_from_user(&fb->staging, arg, sizeof(fb->staging))) {
+		retval = -EFAULT;
+		goto exit;
+	}
+
+	if (!mk2_frame_valid(&fb->staging)) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	fb->next = fb->staging;
+	retval = mk2_fb_update(dev, mfile->flags & MK2_FLAG_LATEST_WINS, flags);
+
+exit:
+	mutex_unlock(&fb->lock);
+	return retval;
+}
+
+static long mk2_ioctl_set_led(struct mk2_file *mfile, void __user *arg, unsigned int flags)
+{
+	struct mk2dev *dev = mfile->dev;
+	struct mk2_fb *fb = &dev->fb;
+	struct mk2_led_update update;
+	long retval;
+
+	if (copy_from_user(&update, arg, sizeof(update)))
+		return -EFAULT;
+
+	if (update.index >= MK2_LED_COUNT || !mk2_led_valid(&update.led))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&fb->lock))
+		return -ERESTARTSYS;
+
+	fb->next.leds[update.index] = update.led;
+	retval = mk2_fb_update(dev, mfile->flags & MK2_FLAG_LATEST_WINS, flags);
+
+	mutex_unlock(&fb->lock);
+	return retval;
+}
+
+/*
+ * Displays the mapped back buffer and makes the other page the new back
+ * buffer. Returns index of the new back buffer.
+ */
+static long mk2_ioctl_flip(struct mk2_file *mfile, unsigned int flags)
+{
+	struct mk2dev *dev = mfile->dev;
+	struct mk2_fb *fb = &dev->fb;
+	long retval;
+
+	if (mutex_lock_interruptible(&fb->lock))
+		return -ERESTARTSYS;
+
+	// Userspace may keep drawing into the page, work on a snapshot
+	memcpy(&fb->staging, mk2_fb_page(fb, fb->back), sizeof(fb->staging));
+
+	if (!mk2_frame_valid(&fb->staging)) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	fb->next = fb->staging;
+	retval = mk2_fb_update(dev, mfile->flags & MK2_FLAG_LATEST_WINS, flags);
+	if (retval < 0)
+		goto exit;
+
+	fb->back = (fb->back + 1) % MK2_FB_BUFFERS;
+	retval = fb->back;
+
+exit:
+	mutex_unlock(&fb->lock);
+	return retval;
+}
+
+/*
+ * Marks LEDs first, first + stride, ... as changed behind the framebuffer.
+ */
+static void mk2_fb_override(struct mk2_fb *fb, unsigned int first,
+			    unsigned int count, unsigned int stride)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		set_bit(first + i * stride, fb->overridden);
+}
+
+/*
+ * Encodes the body of a command, what follows the sysex header, into buf
+ * and records which LEDs it changes. text is the already checked text of a
+ * scroll text command. Returns body size.
+ */
+static size_t mk2_command_build(struct mk2dev *dev, const struct mk2_command *cmd,
+				const u8 *text, u8 *buf)
+{
+	struct mk2_fb *fb = &dev->fb;
+	const u8 colour = cmd->led.palette;
+	u8 *p = buf;
+	int palette;
+
+	switch (cmd->op) {
+	case MK2_OP_SET_LED:
+		palette = mk2_led_palette(&cmd->led);
+		if (palette >= 0) {
+			*p++ = MK2_CMD_LED_PALETTE;
+			*p++ = mk2_led_id(cmd->index);
+			*p++ = palette;
+		} else {
+			*p++ = MK2_CMD_LED_RGB;
+			*p++ = mk2_led_id(cmd->index);
+			*p++ = cmd->led.red;
+			*p++ = cmd->led.green;
+			*p++ = cmd->led.blue;
+		}
+		mk2_fb_override(fb, cmd->index, 1, 1);
+		break;
+
+	case MK2_OP_FLASH:
+	case MK2_OP_PULSE:
+		*p++ = cmd->op == MK2_OP_FLASH ? MK2_CMD_FLASH : MK2_CMD_PULSE;
+		*p++ = 0;
+		*p++ = mk2_led_id(cmd->index);
+		*p++ = colour;
+		mk2_fb_override(fb, cmd->index, 1, 1);
+		break;
+
+	case MK2_OP_ROW:
+		*p++ = MK2_CMD_ROW;
+		*p++ = cmd->index;
+		*p++ = colour;
+		if (cmd->index < MK2_ROWS - 1)
+			mk2_fb_override(fb, cmd->index * 9, 9, 1);
+		else
+			mk2_fb_override(fb, MK2_GRID_LED_COUNT,
+					MK2_LED_COUNT - MK2_GRID_LED_COUNT, 1);
+		break;
+
+	case MK2_OP_COLUMN:
+		*p++ = MK2_CMD_COLUMN;
+		*p++ = cmd->index;
+		*p++ = colour;
+		mk2_fb_override(fb, cmd->index, 8, 9);
+		if (cmd->index < MK2_COLUMNS - 1)
+			mk2_fb_override(fb, MK2_GRID_LED_COUNT + cmd->index, 1, 1);
+		break;
+
+	case MK2_OP_ALL:
+		*p++ = MK2_CMD_ALL_PALETTE;
+		*p++ = colour;
+		mk2_fb_override(fb, 0, MK2_LED_COUNT, 1);
+		break;
+
+	case MK2_OP_SCROLL_TEXT:
+		*p++ = MK2_CMD_SCROLL_TEXT;
+		// No text stops the text scrolling
+		if (cmd->text_len) {
+			*p++ = colour;
+			*p++ = !!(cmd->flags & MK2_COMMAND_LOOP);
+			memcpy(p, text, cmd->text_len);
+			p += cmd->text_len;
+		}
+		mk2_fb_override(fb, 0, MK2_LED_COUNT, 1);
+		break;
+	}
+
+	*p++ = MK2_SYSEX_END;
+	return p - buf;
+}
+
+/*
+ * Checks fields of a command, text of scrolled text is checked once copied.
+ */
+static bool mk2_command_valid(const struct mk2_command *cmd)
+{
+	unsigned int limit;
+
+	if (cmd->reserved || (cmd->flags & ~MK2_COMMAND_LOOP) ||
+	    !mk2_led_valid(&cmd->led))
+		return false;
+
+	switch (cmd->op) {
+	case MK2_OP_SET_LED:
+		return cmd->index < MK2_LED_COUNT;
+
+	case MK2_OP_FLASH:
+	case MK2_OP_PULSE:
+		limit = MK2_LED_COUNT;
+		break;
+
+	case MK2_OP_ROW:
+		limit = MK2_ROWS;
+		break;
+
+	case MK2_OP_COLUMN:
+		limit = MK2_COLUMNS;
+		break;
+
+	case MK2_OP_ALL:
+		limit = 1;
+		break;
+
+	case MK2_OP_SCROLL_TEXT:
+		if (cmd->text_len > MK2_MAX_TEXT_LEN)
+			return false;
+		limit = 1;
+		break;
+
+	default:
+		return false;
+	}
+
+	// Everything but set LED takes a palette colour
+	return cmd->index < limit && !cmd->led.red && !cmd->led.green && !cmd->led.blue;
+}
+
+/*
+ * Sends stuffed commands the same way mk2_write sends a write, through the
+ * per file scheduler unless the file writes on the priority lane.
+ */
+static ssize_t mk2_commands_send(struct mk2_file *mfile, const char *buf, size_t len,
+				 unsigned int flags)
+{
+	ssize_t retval;
+
+	flags |= MK2_WRITE_STUFFED;
+
+	if (flags & MK2_WRITE_PRIORITY)
+		return mk2_write_message(mfile->dev, NULL, buf, len, flags);
+
+	retval = mk2_sched_enter(mfile->dev, &mfile->write_ctx, len,
+				 flags & MK2_WRITE_NONBLOCK);
+	if (retval < 0)
+		return retval;
+
+	retval = mk2_write_message(mfile->dev, NULL, buf, len, flags);
+	mk2_sched_exit(mfile->dev, &mfile->write_ctx);
+
+	return retval;
+}
+
+/*
+ * Encodes a batch of commands and sends them packed into as few urbs as
+ * they fit. Each message is stuffed here, starting with the stuffed header,
+ * so the write path only copies them. Commands, texts included, are all
+ * checked before any is sent. Output that went out before a failed write is
+ * not taken back.
+ */
+static long mk2_ioctl_commands(struct mk2_file *mfile, void __user *arg, unsigned int flags)
+{
+	struct mk2dev *dev = mfile->dev;
+	struct mk2_command *cmds;
+	struct mk2_commands req;
+	size_t len = 0, size, n, text_size = 0;
+	unsigned int i;
+	long retval = 0;
+	char *out, *body;
+	u8 *texts, *text;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.reserved || req.nr_commands > MK2_MAX_COMMANDS)
+		return -EINVAL;
+
+	if (!req.nr_commands)
+		return 0;
+
+	cmds = memdup_user(u64_to_user_ptr(req.commands),
+			   req.nr_commands * sizeof(*cmds));
+	if (IS_ERR(cmds))
+		return PTR_ERR(cmds);
+
+	for (i = 0; i < req.nr_commands; ++i) {
+		if (!mk2_command_valid(&cmds[i])) {
+			retval = -EINVAL;
+			goto exit_cmds;
+		}
+
+		if (cmds[i].op == MK2_OP_SCROLL_TEXT)
+			text_size += cmds[i].text_len;
+	}
+
+	// Longest body is scrolled text, the command, colour, loop and the end,
+	// followed by texts of the whole batch
+	out = kmalloc(MK2_WRITE_SLOT_SIZE + MK2_MAX_TEXT_LEN + 4 + text_size, GFP_KERNEL);
+	if (!out) {
+		retval = -ENOMEM;
+		goto exit_cmds;
+	}
+	body = out + MK2_WRITE_SLOT_SIZE;
+	texts = (u8 *)body + MK2_MAX_TEXT_LEN + 4;
+
+	for (i = 0, text = texts; i < req.nr_commands; ++i) {
+		if (cmds[i].op != MK2_OP_SCROLL_TEXT)
+			continue;
+
+		if (copy_from_user(text, u64_to_user_ptr(cmds[i].text), cmds[i].text_len)) {
+			retval = -EFAULT;
+			goto exit_out;
+		}
+
+		if (mk2_text_invalid(text, cmds[i].text_len)) {
+			retval = -EINVAL;
+			goto exit_out;
+		}
+
+		text += cmds[i].text_len;
+	}
+
+	for (i = 0, text = texts; i < req.nr_commands; ++i) {
+		n = mk2_command_build(dev, &cmds[i], text, (u8 *)body);
+		if (cmds[i].op == MK2_OP_SCROLL_TEXT)
+			text += cmds[i].text_len;
+
+		size = sizeof(mk2_stuffed_header) + compute_stuffed_size(n);
+		if (len + size > MK2_WRITE_SLOT_SIZE) {
+			retval = mk2_commands_send(mfile, out, len, flags);
+			if (retval < 0)
+				break;
+			len = 0;
+		}
+
+		memcpy(out + len, mk2_stuffed_header, sizeof(mk2_stuffed_header));
+		mk2_stuff_buffer(out + len + sizeof(mk2_stuffed_header), body, n, true);
+		len += size;
+	}
+
+	if (len && retval >= 0)
+		retval = mk2_commands_send(mfile, out, len, flags);
+
+exit_out:
+	kfree(out);
+exit_cmds:
+	kfree(cmds);
+	return retval < 0 ? retval : 0;
+}
+
+/*
+ * Stops playback and lets the device autosuspend again. Must be called with
+ * fb->lock held.
+ */
+static void mk2_clip_stop(struct mk2dev *dev)
+{
+	struct mk2_clip *clip = &dev->clip;
+
+	WRITE_ONCE(clip->period_ns, 0);
+	hrtimer_cancel(&clip->timer);
+
+	if (clip->playing) {
+		clip->playing = false;
+		usb_autopm_put_interface(dev->interface);
+	}
+}
+
+/*
+ * Shows the next clip frame. Goes through the framebuffer in latest wins
+ * mode, so a slow pipe drops frames instead of falling behind, and with the
+ * refresh rate set frames go out on vblanks.
+ */
+static void mk2_clip_work(struct work_struct *work)
+{
+	struct mk2dev *dev = container_of(work, struct mk2dev, clip.work);
+	struct mk2_clip *clip = &dev->clip;
+	struct mk2_fb *fb = &dev->fb;
+
+	mutex_lock(&fb->lock);
+
+	if (!clip->playing)
+		goto exit;
+
+	fb->next = clip->frames[clip->pos];
+	mk2_fb_update(dev, true, 0);
+
+	if (++clip->pos < clip->nr_frames)
+		goto exit;
+
+	clip->pos = 0;
+	if (!clip->loop)
+		mk2_clip_stop(dev);
+
+exit:
+	mutex_unlock(&fb->lock);
+}
+
+static enum hrtimer_restart mk2_clip_tick(struct hrtimer *timer)
+{
+	struct mk2dev *dev = container_of(timer, struct mk2dev, clip.timer);
+	u64 period = READ_ONCE(dev->clip.period_ns);
+
+	if (!period)
+		return HRTIMER_NORESTART;
+
+	schedule_work(&dev->clip.work);
+
+	hrtimer_forward_now(timer, ns_to_ktime(period));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Replaces the clip, stopping playback. A clip of no frames just frees the
+ * old one.
+ */
+static long mk2_ioctl_load_clip(struct mk2dev *dev, void __user *arg)
+{
+	struct mk2_clip *clip = &dev->clip;
+	struct mk2_frame *frames = NULL;
+	struct mk2_clip_data req;
+	unsigned int i;
+	long retval;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.reserved)
+		return -EINVAL;
+
+	if (req.nr_frames > MK2_MAX_CLIP_FRAMES)
+		return -E2BIG;
+
+	if (req.nr_frames) {
+		frames = vmalloc(req.nr_frames * sizeof(*frames));
+		if (!frames)
+			return -ENOMEM;
+
+		if (copy_from_user(frames, u64_to_user_ptr(req.frames),
+				   req.nr_frames * sizeof(*frames))) {
+			retval = -EFAULT;
+			goto error;
+		}
+
+		for (i = 0; i < req.nr_frames; ++i) {
+			if (!mk2_frame_valid(&frames[i])) {
+				retval = -EINVAL;
+				goto error;
+			}
+		}
+	}
+
+	if (mutex_lock_interruptible(&dev->fb.lock)) {
+		retval = -ERESTARTSYS;
+		goto error;
+	}
+
+	if (dev->state.disconnected) {
+		mutex_unlock(&dev->fb.lock);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	mk2_clip_stop(dev);
+	swap(clip->frames, frames);
+	clip->nr_frames = req.nr_frames;
+	clip->pos = 0;
+
+	mutex_unlock(&dev->fb.lock);
+
+	// The old clip
+	vfree(frames);
+	return 0;
+
+error:
+	vfree(frames);
+	return retval;
+}
+
+static long mk2_ioctl_play_clip(struct mk2dev *dev, void __user *arg)
+{
+	struct mk2_clip *clip = &dev->clip;
+	struct mk2_clip_play req;
+	long retval = 0;
+	u64 period;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.flags & ~MK2_CLIP_FLAGS_ALL)
+		return -EINVAL;
+
+	if (req.rate < 1 || req.rate > MK2_MAX_REFRESH_RATE)
+		return -EINVAL;
+
+	period = div_u64(NSEC_PER_SEC, req.rate);
+
+	if (mutex_lock_interruptible(&dev->fb.lock))
+		return -ERESTARTSYS;
+
+	if (dev->state.disconnected) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (!clip->nr_frames) {
+		retval = -ENODATA;
+		goto exit;
+	}
+
+	// Playback outlives the file, keep the device awake for it
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval)
+		goto exit;
+
+	mk2_clip_stop(dev);
+
+	clip->pos = 0;
+	clip->loop = req.flags & MK2_CLIP_LOOP;
+	clip->playing = true;
+	WRITE_ONCE(clip->period_ns, period);
+
+	// First frame goes out right away
+	schedule_work(&clip->work);
+	hrtimer_start(&clip->timer, ns_to_ktime(period), HRTIMER_MODE_REL_SOFT);
+
+exit:
+	mutex_unlock(&dev->fb.lock);
+	return retval;
+}
+
+/*
+ * Carries out the reaction to a button event, called from the read
+ * completion. The response is queued as a timed message that is already due,
+ * so it goes out right away unless the pipe is full, in which case it takes
+ * the priority slot or the first urb that completes.
+ */
+static void mk2_react(struct mk2dev *dev, u8 id, u8 velocity)
+{
+	struct mk2_react *react = &dev->react;
+	struct mk2_fb *fb = &dev->fb;
+	struct mk2_react_rule rule;
+	struct mk2_timed_msg *msg;
+	unsigned long flags;
+	struct mk2_led led;
+	int index, colour;
+	char *p;
+
+	if (!READ_ONCE(react->nr_rules))
+		return;
+
+	index = mk2_led_index(id);
+	if (index < 0)
+		return;
+
+	spin_lock_irqsave(&react->lock, flags);
+	rule = react->rules[index][velocity ? MK2_REACT_PRESS : MK2_REACT_RELEASE];
+	spin_unlock_irqrestore(&react->lock, flags);
+
+	if (rule.action == MK2_REACT_NONE)
+		return;
+
+	led = rule.led;
+	if (rule.action == MK2_REACT_RESTORE) {
+		// Racy against a commit, which sends the LED itself anyway
+		if (READ_ONCE(fb->valid))
+			led = READ_ONCE(fb->shadow.leds[rule.target]);
+		else
+			memset(&led, 0, sizeof(led));
+		clear_bit(rule.target, fb->overridden);
+	} else {
+		set_bit(rule.target, fb->overridden);
+	}
+
+	// Largest response is a single rgb entry
+	msg = kmalloc(struct_size(msg, data, sizeof(mk2_sysex_header) + 6), GFP_ATOMIC);
+	if (!msg)
+		return;
+
+	p = msg->data;
+	memcpy(p, mk2_sysex_header, sizeof(mk2_sysex_header));
+	p += sizeof(mk2_sysex_header);
+
+	colour = mk2_led_palette(&led);
+	if (rule.action == MK2_REACT_FLASH) {
+		*p++ = MK2_CMD_FLASH;
+		*p++ = 0;
+		*p++ = mk2_led_id(rule.target);
+		*p++ = colour;
+	} else if (colour >= 0) {
+		*p++ = MK2_CMD_LED_PALETTE;
+		*p++ = mk2_led_id(rule.target);
+		*p++ = colour;
+	} else {
+		*p++ = MK2_CMD_LED_RGB;
+		*p++ = mk2_led_id(rule.target);
+		*p++ = led.red;
+		*p++ = led.green;
+		*p++ = led.blue;
+	}
+	*p++ = MK2_SYSEX_END;
+
+	msg->time = 0;
+	msg->len = p - msg->data;
+	msg->reaction = true;
+
+	if (mk2_timed_queue(dev, msg) < 0)
+		dev_warn_ratelimited(&dev->interface->dev, "dropping reaction\n");
+}
+
+static long mk2_ioctl_set_reaction(struct mk2dev *dev, void __user *arg)
+{
+	struct mk2_react *react = &dev->react;
+	struct mk2_react_rule *rule;
+	struct mk2_reaction req;
+	bool was_set;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.button >= MK2_LED_COUNT || req.target >= MK2_LED_COUNT ||
+	    req.edge > MK2_REACT_RELEASE || req.action > MK2_REACT_FLASH ||
+	    req.reserved[0] || req.reserved[1] || !mk2_led_valid(&req.led))
+		return -EINVAL;
+
+	// The device only flashes palette colours
+	if (req.action == MK2_REACT_FLASH && !req.led.palette)
+		return -EINVAL;
+
+	spin_lock_irq(&react->lock);
+
+	rule = &react->rules[req.button][req.edge];
+	was_set = rule->action != MK2_REACT_NONE;
+
+	rule->action = req.action;
+	rule->target = req.target;
+	rule->led = req.led;
+
+	if (was_set && req.action == MK2_REACT_NONE)
+		--react->nr_rules;
+	else if (!was_set && req.action != MK2_REACT_NONE)
+		++react->nr_rules;
+
+	spin_unlock_irq(&react->lock);
+
+	return 0;
+}
+
+static void mk2_clear_reactions(struct mk2dev *dev)
+{
+	struct mk2_react *react = &dev->react;
+
+	spin_lock_irq(&react->lock);
+	memset(react->rules, 0, sizeof(react->rules));
+	react->nr_rules = 0;
+	spin_unlock_irq(&react->lock);
+}
+
+/*
+ * Splits received USB-MIDI packets into events. Packets that carry no MIDI
+ * payload are skipped.
+ */
+static void mk2_read_decode(struct mk2dev *dev, const unsigned char *buf, size_t len)
+{
+	// Payload length of each code index number, 0 for packets carrying
+	// nothing we pass on
+	static const u8 cin_len[16] = {
+		[MK2_SYSEX_MOREDATA]	= 3,
+		[MK2_SYSEX_DATAEND1]	= 1,
+		[MK2_SYSEX_DATAEND2]	= 2,
+		[MK2_SYSEX_DATAEND3]	= 3,
+		[MK2_SYSEX_BUTTON]	= 3,
+		[MK2_SYSEX_SBUTTON]	= 3,
+	};
+	struct mk2_read_endp *endpoint = &dev->read_endp;
+	struct mk2_event event;
+	u32 packet;
+	bool dropped;
+	size_t i;
+
+	event.timestamp = ktime_get();
+
+	for (i = 0; i + MK2_STUFFED_PACKET_SIZE <= len; i += MK2_STUFFED_PACKET_SIZE) {
+		packet = get_unaligned_le32(buf + i);
+
+		event.type = packet & 0x0f;
+		event.len = cin_len[event.type];
+		if (!event.len)
+			continue;
+
+		event.payload = packet >> 8;
+		event.sequence = endpoint->sequence++;
+
+		dropped = !kfifo_put(&endpoint->events, event);
+		mk2_stat_inc(dev, read_events);
+		if (dropped)
+			mk2_stat_inc(dev, read_overruns);
+		trace_mk2_decode(dev->interface->minor, event.type, event.payload,
+				 event.sequence, dropped);
+
+		if (dropped)
+			dev_warn_ratelimited(&dev->interface->dev,
+					     "input queue full, dropping events\n");
+
+		if (event.type == MK2_SYSEX_BUTTON || event.type == MK2_SYSEX_SBUTTON)
+			mk2_react(dev, event.payload >> 8, event.payload >> 16);
+	}
+}
+
+/*
+ * Restarts reading after a stall or repeated protocol errors. Killing the
+ * rest of the urbs leaves the endpoint idle, as clearing the halt needs.
+ */
+static void mk2_read_recover(struct work_struct *work)
+{
+	struct mk2_read_endp *endpoint = container_of(to_delayed_work(work),
+						      struct mk2_read_endp, recover_work);
+	struct mk2dev *dev = container_of(endpoint, struct mk2dev, read_endp);
+	int retval;
+
+	mutex_lock(&endpoint->urbs_mutex);
+
+	// Disarmed meanwhile, the next open submits the urbs anew
+	if (!endpoint->armed || dev->state.disconnected)
+		goto exit;
+
+	usb_kill_anchored_urbs(&endpoint->submitted);
+	endpoint->retries = 0;
+
+	retval = usb_clear_halt(dev->udev, usb_rcvbulkpipe(dev->udev, endpoint->address));
+	if (retval < 0)
+		dev_err(&dev->interface->dev,
+			"%s - failed clearing read halt, error %d\n",
+			__func__, retval);
+
+	retval = mk2_read_submit_all(endpoint);
+	if (retval < 0) {
+		spin_lock_irq(&endpoint->err_lock);
+		endpoint->errors = retval;
+		spin_unlock_irq(&endpoint->err_lock);
+		wake_up_interruptible(&endpoint->wait_queue);
+	}
+
+exit:
+	mutex_unlock(&endpoint->urbs_mutex);
+}
+
+static void mk2_read_bulk_callback(struct urb *urb)
+{
+	struct mk2_read_slot *slot;
+	struct mk2dev *dev;
+	struct mk2_read_endp *endpoint;
+	unsigned long irqstate;
+	int retval;
+
+	slot = urb->context;
+	dev = slot->dev;
+	endpoint = &dev->read_endp;
+
+	trace_mk2_read_complete(dev->interface->minor, urb->actual_length, urb->status,
+				ktime_to_ns(ktime_sub(ktime_get(), slot->submitted)));
+
+	mk2_stat_inc(dev, read_completed);
+	if (urb->status)
+		mk2_stat_inc(dev, read_status[mk2_stat_status(urb->status)]);
+
+	switch (urb->status) {
+	case 0:
+		break;
+
+	// Killed, either disarmed or disconnected
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		return;
+
+	default:
+		dev_err_ratelimited(&dev->interface->dev,
+				    "%s - nonzero read bulk status received: %d\n",
+				    __func__, urb->status);
+
+		spin_lock_irqsave(&endpoint->err_lock, irqstate);
+		endpoint->errors = urb->status;
+		spin_unlock_irqrestore(&endpoint->err_lock, irqstate);
+		wake_up_interruptible(&endpoint->wait_queue);
+
+		if (urb->status == -ENODEV)
+			return;
+
+		// Stalled, resubmitting would only fail again until the halt
+		// is cleared
+		if (urb->status == -EPIPE) {
+			schedule_delayed_work(&endpoint->recover_work, 0);
+			return;
+		}
+
+		// Protocol, crc, timeout and overflow errors are usually
+		// transient, unless they keep coming
+		if (++endpoint->retries > MK2_READ_RETRIES) {
+			schedule_delayed_work(&endpoint->recover_work,
+					      msecs_to_jiffies(MK2_READ_RESTART_DELAY_MS));
+			return;
+		}
+
+		goto resubmit;
+	}
+
+	endpoint->retries = 0;
+
+	if (static_branch_unlikely(&mk2_hexdump))
+		print_hex_dump(KERN_DEBUG, "mk2 read: ", DUMP_PREFIX_ADDRESS,
+			       16, 1, slot->buf, urb->actual_length, true);
+
+	mk2_read_decode(dev, slot->buf, urb->actual_length);
+	wake_up_interruptible(&endpoint->wait_queue);
+
+resubmit:
+	usb_anchor_urb(urb, &endpoint->submitted);
+	slot->submitted = ktime_get();
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	trace_mk2_read_submit(dev->interface->minor, urb->transfer_buffer_length, retval);
+	if (!retval) {
+		mk2_stat_inc(dev, read_submitted);
+		return;
+	}
+
+	usb_unanchor_urb(urb);
+
+	// -EPERM means the urb is being killed
+	if (retval != -EPERM)
+		dev_err_ratelimited(&dev->interface->dev,
+				    "%s - failed resubmitting read urb, error %d\n",
+				    __func__, retval);
+}
+
+/*
+ * Submits every read urb. Must be called with urbs_mutex held.
+ */
+static int mk2_read_submit_all(struct mk2_read_endp *endpoint)
+{
+	struct mk2dev *dev = container_of(endpoint, struct mk2dev, read_endp);
+	struct mk2_read_slot *slot;
+	unsigned int i;
+	int retval;
+
+	for (i = 0; i < endpoint->nr_slots; ++i) {
+		slot = &endpoint->slots[i];
+
+		usb_anchor_urb(slot->urb, &endpoint->submitted);
+		slot->submitted = ktime_get();
+		retval = usb_submit_urb(slot->urb, GFP_KERNEL);
+		trace_mk2_read_submit(dev->interface->minor,
+				      slot->urb->transfer_buffer_length, retval);
+		if (retval < 0) {
+			dev_err(&dev->interface->dev,
+				"%s - failed submitting read urb, error %d\n",
+				__func__, retval);
+
+			usb_unanchor_urb(slot->urb);
+			usb_kill_anchored_urbs(&endpoint->submitted);
+			return (retval == -ENOMEM) ? retval : -EIO;
+		}
+
+		mk2_stat_inc(dev, read_submitted);
+	}
+
+	return 0;
+}
+
+/*
+ * Input urbs are kept submitted while at least one file is open, so that no
+ * press has to wait for a reader to ask for it.
+ */
+static int mk2_read_arm(struct mk2_read_endp *endpoint)
+{
+	struct mk2dev *dev = container_of(endpoint, struct mk2dev, read_endp);
+	int retval = 0;
+
+	mutex_lock(&endpoint->urbs_mutex);
+
+	if (dev->state.disconnected) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (endpoint->armed == 0) {
+		retval = mk2_read_submit_all(endpoint);
+		if (retval < 0)
+			goto exit;
+	}
+
+	++endpoint->armed;
+
+exit:
+	mutex_unlock(&endpoint->urbs_mutex);
+	return retval;
+}
+
+static void mk2_read_disarm(struct mk2_read_endp *endpoint)
+{
+	mutex_lock(&endpoint->urbs_mutex);
+	if (--endpoint->armed == 0)
+		usb_kill_anchored_urbs(&endpoint->submitted);
+	mutex_unlock(&endpoint->urbs_mutex);
+}
+
+/*
+ * Packs events into staging in the read format the file asked for, as many
+ * as fit into size. Returns number of bytes staged, *nr_events is updated to
+ * the number of events consumed.
+ */
+VISIBLE_IF_KUNIT size_t mk2_stage_events(u8 *staging, size_t size,
+					  const struct mk2_event *events,
+					  unsigned int *nr_events, bool timestamps)
+{
+	struct mk2_input_event record = {};
+	const struct mk2_event *event;
+	size_t staged = 0;
+	unsigned int i;
+
+	for (i = 0; i < *nr_events; ++i) {
+		event = &events[i];
+
+		if (timestamps) {
+			if (staged + sizeof(record) > size)
+				break;
+
+			record.timestamp = ktime_to_ns(event->timestamp);
+			record.sequence = event->sequence;
+			record.type = event->type;
+			record.data[0] = event->payload;
+			record.data[1] = event->payload >> 8;
+			record.data[2] = event->payload >> 16;
+			memcpy(staging + staged, &record, sizeof(record));
+			staged += sizeof(record);
+		} else {
+			if (staged + event->len > size)
+				break;
+
+			// Whole word is stored, only len bytes of it are kept
+			put_unaligned_le32(event->payload, staging + staged);
+			staged += event->len;
+		}
+	}
+
+	*nr_events = i;
+	return staged;
+}
+EXPORT_SYMBOL_IF_KUNIT(mk2_stage_events);
+
+static ssize_t mk2_read(struct file *filp, char __user *user_buffer, size_t count, loff_t *ppos)
+{
+	struct mk2_file *mfile;
+	struct mk2dev *dev;
+	struct mk2_read_endp *endpoint;
+	unsigned int nr_events, i;
+	ssize_t retval;
+	size_t staged;
+	ktime_t now;
+	bool timestamps;
+
+	mfile = filp->private_data;
+	dev = mfile->dev;
+	endpoint = &dev->read_endp;
+	timestamps = READ_ONCE(mfile->flags) & MK2_FLAG_TIMESTAMPS;
+
+	// TODO: add support for smaller reads
+	if (count < (timestamps ? sizeof(struct mk2_input_event) : MK2_SYSEX_PACKET_SIZE))
+		return -EINVAL;
+
+	retval = mutex_lock_interruptible(&endpoint->io_mutex);
+	if (retval < 0)
+		return retval;
+
+retry:
+	if (dev->state.disconnected) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	spin_lock_irq(&endpoint->err_lock);
+	retval = endpoint->errors;
+	if (retval < 0) {
+		endpoint->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&endpoint->err_lock);
+	if (retval < 0)
+		goto exit;
+
+	if (kfifo_is_empty(&endpoint->events)) {
+		if (filp->f_flags & O_NONBLOCK) {
+			retval = -EAGAIN;
+			goto exit;
+		}
+
+		// Don't hold off other readers or reconfiguration while waiting
+		mutex_unlock(&endpoint->io_mutex);
+
+		retval = wait_event_interruptible(endpoint->wait_queue,
+				!kfifo_is_empty(&endpoint->events) ||
+				READ_ONCE(endpoint->errors) ||
+				dev->state.disconnected);
+		if (retval < 0)
+			return retval;
+
+		retval = mutex_lock_interruptible(&endpoint->io_mutex);
+		if (retval < 0)
+			return retval;
+
+		goto retry;
+	}
+
+	nr_events = kfifo_out_peek(&endpoint->events, endpoint->batch, MK2_READ_BATCH);
+	staged = mk2_stage_events(endpoint->staging,
+				  min(count, sizeof(endpoint->staging) - sizeof(u32)),
+				  endpoint->batch, &nr_events, timestamps);
+
+	if (copy_to_user(user_buffer, endpoint->staging, staged)) {
+		retval = -EFAULT;
+		goto exit;
+	}
+
+	now = ktime_get();
+	for (i = 0; i < nr_events; ++i)
+		mk2_stat_inc(dev, read_latency[mk2_hist_bucket(
+			ktime_to_ns(ktime_sub(now, endpoint->batch[i].timestamp)))]);
+
+	// Events are consumed only once userspace got them
+	while (nr_events--)
+		kfifo_skip(&endpoint->events);
+
+	retval = staged;
+
+exit:
+	mutex_unlock(&endpoint->io_mutex);
+	return retval;
+}
+
+static __poll_t mk2_poll(struct file *filp, poll_table *wait)
+{
+	struct mk2_file *mfile;
+	struct mk2dev *dev;
+	__poll_t mask = 0;
+	bool writable;
+	int werr;
+
+	mfile = filp->private_data;
+	dev = mfile->dev;
+
+	poll_wait(filp, &dev->read_endp.wait_queue, wait);
+	poll_wait(filp, &dev->write_endp.wait_queue, wait);
+
+	if (dev->state.disconnected)
+		return EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP;
+
+	if (!kfifo_is_empty(&dev->read_endp.events))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	if (READ_ONCE(dev->read_endp.errors))
+		mask |= EPOLLERR;
+
+	// Only writers can clear write errors, and killed urbs are no error
+	// worth waking them for
+	werr = READ_ONCE(dev->write_endp.errors);
+	if ((filp->f_mode & FMODE_WRITE) && werr &&
+	    werr != -ENOENT && werr != -ECONNRESET && werr != -ESHUTDOWN)
+		mask |= EPOLLERR;
+
+	// Free slot and no other file's turn means the next write doesn't have
+	// to wait, priority writes skip the turns
+	spin_lock_irq(&dev->write_endp.slots_lock);
+	writable = !list_empty(&dev->write_endp.free_slots);
+	spin_unlock_irq(&dev->write_endp.slots_lock);
+
+	if (writable && !(READ_ONCE(mfile->flags) & MK2_FLAG_PRIORITY)) {
+		spin_lock(&dev->write_endp.sched_lock);
+		writable = !dev->write_endp.sched_owner &&
+			   list_empty(&dev->write_endp.sched_queue);
+		spin_unlock(&dev->write_endp.sched_lock);
+	}
+
+	if (writable)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static long mk2_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct mk2_file *mfile;
+	struct mk2dev *dev;
+	void __user *argp = (void __user *)arg;
+	__u32 flags;
+
+	mfile = filp->private_data;
+	dev = mfile->dev;
+
+	switch (cmd) {
+	case MK2_IOC_COMMIT_FRAME:
+		return mk2_ioctl_commit_frame(mfile, argp, mk2_write_flags(filp));
+
+	case MK2_IOC_SET_LED:
+		return mk2_ioctl_set_led(mfile, argp, mk2_write_flags(filp));
+
+	case MK2_IOC_INVALIDATE:
+		if (mutex_lock_interruptible(&dev->fb.lock))
+			return -ERESTARTSYS;
+		dev->fb.valid = false;
+		mutex_unlock(&dev->fb.lock);
+		return 0;
+
+	case MK2_IOC_FLIP:
+		return mk2_ioctl_flip(mfile, mk2_write_flags(filp));
+
+	case MK2_IOC_SET_FLAGS:
+		if (get_user(flags, (__u32 __user *)argp))
+			return -EFAULT;
+		if (flags & ~MK2_FLAGS_ALL)
+			return -EINVAL;
+		WRITE_ONCE(mfile->flags, flags);
+		return 0;
+
+	case MK2_IOC_GET_FLAGS:
+		return put_user(READ_ONCE(mfile->flags), (__u32 __user *)argp);
+
+	case MK2_IOC_WAIT_VBLANK:
+		return mk2_ioctl_wait_vblank(dev, argp);
+
+	case MK2_IOC_QUEUE_TIMED:
+		return mk2_ioctl_queue_timed(dev, argp);
+
+	case MK2_IOC_CLEAR_TIMED:
+		mk2_timed_clear(&dev->write_endp);
+		return 0;
+
+	case MK2_IOC_LOAD_CLIP:
+		return mk2_ioctl_load_clip(dev, argp);
+
+	case MK2_IOC_PLAY_CLIP:
+		return mk2_ioctl_play_clip(dev, argp);
+
+	case MK2_IOC_STOP_CLIP:
+		if (mutex_lock_interruptible(&dev->fb.lock))
+			return -ERESTARTSYS;
+		mk2_clip_stop(dev);
+		mutex_unlock(&dev->fb.lock);
+		return 0;
+
+	case MK2_IOC_SET_REACTION:
+		return mk2_ioctl_set_reaction(dev, argp);
+
+	case MK2_IOC_CLEAR_REACTIONS:
+		mk2_clear_reactions(dev);
+		return 0;
+
+	case MK2_IOC_COMMANDS:
+		return mk2_ioctl_commands(mfile, argp, mk2_write_flags(filp));
+
+	case MK2_IOC_BARRIER:
+		if (get_user(flags, (__u32 __user *)argp))
+			return -EFAULT;
+		return mk2_write_barrier(dev, msecs_to_jiffies(flags));
+
+	case MK2_IOC_SET_WRITE_WEIGHT:
+		if (get_user(flags, (__u32 __user *)argp))
+			return -EFAULT;
+		if (flags < 1 || flags > MK2_MAX_WRITE_WEIGHT)
+			return -EINVAL;
+		spin_lock(&dev->write_endp.sched_lock);
+		mfile->write_ctx.weight = flags;
+		spin_unlock(&dev->write_endp.sched_lock);
+		return 0;
+
+	case MK2_IOC_GET_WRITE_WEIGHT:
+		return put_user(READ_ONCE(mfile->write_ctx.weight), (__u32 __user *)argp);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int mk2_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct mk2_file *mfile;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	mfile = filp->private_data;
+
+	if (vma->vm_pgoff >= MK2_FB_BUFFERS ||
+	    size > (MK2_FB_BUFFERS - vma->vm_pgoff) * PAGE_SIZE)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, mfile->dev->fb.pages, vma->vm_pgoff);
+}
+
+static const struct file_operations mk2_fops = {
+	.owner   =	THIS_MODULE,
+	.read    =	mk2_read,
+	.write   =	mk2_write,
+	.fsync   =	mk2_fsync,
+	.flush   =	mk2_flush,
+	.poll    =	mk2_poll,
+	.unlocked_ioctl = mk2_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.mmap    =	mk2_mmap,
+	.open    =	mk2_open,
+	.release =	mk2_release,
+	.llseek  =	noop_llseek,
+};
+
+static struct usb_class_driver mk2_class = {
+	.name =		"mk2-%d",
+	.fops =		&mk2_fops,
+	.minor_base = 	USB_MK2_MINOR_BASE,
+};
+
+static void mk2_write_slot_free(struct mk2_write_slot *slot)
+{
+	usb_free_coherent(slot->dev->udev, MK2_WRITE_SLOT_SIZE,
+			  slot->buf, slot->urb->transfer_dma);
+	usb_free_urb(slot->urb);
+	kfree(slot);
+}
+
+static struct mk2_write_slot *mk2_write_slot_alloc(struct mk2dev *dev)
+{
+	struct mk2_write_slot *slot;
+
+	slot = kzalloc(sizeof(*slot), GFP_KERNEL);
+	if (!slot)
+		return NULL;
+
+	slot->dev = dev;
+	slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!slot->urb)
+		goto error;
+
+	slot->buf = usb_alloc_coherent(dev->udev, MK2_WRITE_SLOT_SIZE,
+				       GFP_KERNEL, &slot->urb->transfer_dma);
+	if (!slot->buf)
+		goto error_free_urb;
+
+	return slot;
+
+error_free_urb:
+	usb_free_urb(slot->urb);
+error:
+	kfree(slot);
+	return NULL;
+}
+
+/*
+ * Grows or shrinks the slot pool to depth slots, which also resizes the
+ * limit_sem budget. Shrinking waits for slots in flight to come back.
+ * Caller must hold io_mutex, so that no writer takes slots meanwhile.
+ */
+static int mk2_write_pool_resize(struct mk2_write_endp *endpoint, unsigned int depth)
+{
+	struct mk2dev *dev = container_of(endpoint, struct mk2dev, write_endp);
+	struct mk2_write_slot *slot;
+
+	while (endpoint->depth < depth) {
+		slot = mk2_write_slot_alloc(dev);
+		if (!slot)
+			return -ENOMEM;
+
+		mk2_put_write_slot(endpoint, slot);
+		++endpoint->depth;
+	}
+	wake_up_interruptible(&endpoint->wait_queue);
+
+	if (endpoint->depth > depth) {
+		// Don't let collected messages wait for the coalescing deadline
+		spin_lock_irq(&endpoint->slots_lock);
+		mk2_flush_pending(endpoint);
+		spin_unlock_irq(&endpoint->slots_lock);
+	}
+
+	while (endpoint->depth > depth) {
+		if (down_interruptible(&endpoint->limit_sem))
+			return -ERESTARTSYS;
+
+		slot = mk2_get_write_slot(endpoint);
+		mk2_write_slot_free(slot);
+		--endpoint->depth;
+	}
+
+	return 0;
+}
+
+/*
+ * Frees every slot on the free list. All write urbs have to be completed
+ * or killed by now.
+ */
+static void mk2_write_pool_free(struct mk2_write_endp *endpoint)
 {
-	size_t blk, rem, oi = 0, ii = 0;
+	struct mk2_write_slot *slot, *tmp;
 
-	blk = count / 3;
-	rem = count % 3;
+	__mk2_timed_clear(endpoint);
 
-	while (blk > 0) {
-		buf[oi+0] = MK2_SYSEX_MOREDATA;
-		buf[oi+1] = user_buffer[ii+0];
-		buf[oi+2] = user_buffer[ii+1];
-		buf[oi+3] = user_buffer[ii+2];
-		
-		oi += 4;
-		ii += 3;
-		--blk;
+	if (endpoint->prio_slot) {
+		mk2_write_slot_free(endpoint->prio_slot);
+		endpoint->prio_slot = NULL;
 	}
 
-	switch (rem) {
-		case 0:
-			buf[oi-4] = MK2_SYSEX_DATAEND3;
-			break;
-		case 1:
-			buf[oi+0] = MK2_SYSEX_DATAEND1;
-			buf[oi+1] = user_buffer[ii+0];
-			buf[oi+2] = 0;
-			buf[oi+3] = 0;
-			break;
-		case 2:
-			buf[oi+0] = MK2_SYSEX_DATAEND2;
-			buf[oi+1] = user_buffer[ii+0];
-			buf[oi+2] = user_buffer[ii+1];
-			buf[oi+3] = 0;
-			break;
-		default:
-			break;
+	if (endpoint->pending) {
+		mk2_write_slot_free(endpoint->pending);
+		endpoint->pending = NULL;
 	}
 
-	print_hex_dump(KERN_DEBUG, "mk2 write: ", DUMP_PREFIX_ADDRESS,
-			16, 1, buf, stuffed_size, true);
-
+	list_for_each_entry_safe(slot, tmp, &endpoint->free_slots, node) {
+		list_del(&slot->node);
+		mk2_write_slot_free(slot);
+	}
 }
 
 /*
- * Computes size of the buffer with necessary metadata that wraps user's payload
+ * Rounds requested read buffer size up to whole packets, within limits.
  */
-static size_t compute_stuffed_size(size_t payload_size)
+static size_t mk2_read_buffer_size(struct mk2_read_endp *endpoint, size_t size)
 {
-	size_t stuffed_size;
-
-	/* Each packet in sysex message must be padded to max width ie. 4.
-	 * Thats why we round data size up first.
-	 * */
-	stuffed_size  = payload_size + MK2_SYSEX_SIZE_ROUND_UP;
-
-	/* Calculate number of packets */
-	stuffed_size /= MK2_SYSEX_PACKET_SIZE;
-
-	/* Get total data size with stuffed bytes between packets */
-	stuffed_size *= MK2_STUFFED_PACKET_SIZE;
+	size = clamp_t(size_t, size, endpoint->maxp, endpoint->maxp * MK2_MAX_READ_PACKETS);
 
-	return stuffed_size;
+	return roundup(size, endpoint->maxp);
 }
 
-static ssize_t mk2_write(struct file *filp, const char __user *user_buffer_, size_t count, loff_t *ppos)
+static void mk2_read_slots_free(struct mk2dev *dev, struct mk2_read_slot *slots,
+				unsigned int nr_slots, size_t slot_size)
 {
-	struct mk2dev *dev;
-	struct mk2_write_endp *endpoint;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	char *user_buffer = NULL;
-	ssize_t retval = 0;
-	size_t stuffed_size;
+	unsigned int i;
 
-	if (count == 0)
-		goto exit;
+	if (!slots)
+		return;
 
-	count = min(count, USB_MK2_MAX_OUT_LEN);
+	for (i = 0; i < nr_slots; ++i) {
+		if (!slots[i].urb)
+			continue;
 
-	stuffed_size = compute_stuffed_size(count);
+		usb_free_coherent(dev->udev, slot_size, slots[i].buf,
+				  slots[i].urb->transfer_dma);
+		usb_free_urb(slots[i].urb);
+	}
 
-	dev = filp->private_data;
-	endpoint = &dev->write_endp;
+	kfree(slots);
+}
 
-	if (!(filp->f_flags & O_NONBLOCK)) {
-		if (down_interruptible(&endpoint->limit_sem)) {
-			retval = -ERESTARTSYS;
-			goto exit;
-		}
-	} else {
-		if (down_trylock(&endpoint->limit_sem)) {
-			retval = -EAGAIN;
-			goto exit;
+static struct mk2_read_slot *mk2_read_slots_alloc(struct mk2dev *dev, unsigned int nr_slots,
+						  size_t slot_size)
+{
+	struct mk2_read_slot *slots, *slot;
+	unsigned int i;
+
+	slots = kcalloc(nr_slots, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return NULL;
+
+	for (i = 0; i < nr_slots; ++i) {
+		slot = &slots[i];
+		slot->dev = dev;
+
+		slot->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!slot->urb)
+			goto error;
+
+		slot->buf = usb_alloc_coherent(dev->udev, slot_size, GFP_KERNEL,
+					       &slot->urb->transfer_dma);
+		if (!slot->buf) {
+			usb_free_urb(slot->urb);
+			slot->urb = NULL;
+			goto error;
 		}
-	}
-
-	spin_lock_irq(&endpoint->err_lock);
-	retval = endpoint->errors;
-	if (retval < 0) {
-		endpoint->errors = 0;
-		retval = (retval == -EPIPE) ? retval : -EIO;
-	}
-	spin_unlock_irq(&endpoint->err_lock);
-	if (retval < 0)
-		goto error;
-	
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
 
-	buf = usb_alloc_coherent(dev->udev, stuffed_size, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+		usb_fill_bulk_urb(slot->urb, dev->udev,
+				  usb_rcvbulkpipe(dev->udev, dev->read_endp.address),
+				  slot->buf, slot_size, mk2_read_bulk_callback, slot);
+		slot->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	}
 
-	if (unlikely(!access_ok(user_buffer_, count))) {
-		retval = -EINVAL;
-		goto error;
-	}
+	return slots;
 
-	user_buffer = memdup_user(user_buffer_, count);
-	if (IS_ERR(user_buffer)) {
-		retval = PTR_ERR(user_buffer);
-		goto error;
-	}
+error:
+	mk2_read_slots_free(dev, slots, nr_slots, slot_size);
+	return NULL;
+}
 
-	stuff_buffer(buf, stuffed_size, user_buffer, count);
+/*
+ * Replaces read urbs with nr_slots new ones of slot_size bytes each, zero
+ * keeps the current value. If the urbs are armed they are resubmitted, input
+ * arriving while they are swapped is lost.
+ */
+static int mk2_read_pool_resize(struct mk2_read_endp *endpoint, unsigned int nr_slots,
+				size_t slot_size)
+{
+	struct mk2dev *dev = container_of(endpoint, struct mk2dev, read_endp);
+	struct mk2_read_slot *slots;
+	int retval = 0;
 
-	mutex_lock(&endpoint->io_mutex);
-	if (unlikely(dev->state.disconnected)) {
-		mutex_unlock(&endpoint->io_mutex);
-		retval = -ENODEV;
-		goto error;
-	}
+	if (mutex_lock_interruptible(&endpoint->urbs_mutex))
+		return -ERESTARTSYS;
 
-	usb_fill_bulk_urb(urb, dev->udev,
-			  usb_sndbulkpipe(dev->udev, endpoint->address),
-			  buf, stuffed_size, mk2_write_bulk_callback, dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &endpoint->submitted);
+	if (!nr_slots)
+		nr_slots = endpoint->nr_slots;
+	if (!slot_size)
+		slot_size = endpoint->slot_size;
 
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&endpoint->io_mutex);
-	if (retval) {
-		dev_err(&dev->interface->dev,
-			"%s - failed to submit write urb, error %lu\n",
-			__func__, retval);
-		goto error_unanchor;
+	slots = mk2_read_slots_alloc(dev, nr_slots, slot_size);
+	if (!slots) {
+		retval = -ENOMEM;
+		goto exit;
 	}
 
-	usb_free_urb(urb);
+	if (endpoint->armed)
+		usb_kill_anchored_urbs(&endpoint->submitted);
 
-	return count;
+	swap(endpoint->slots, slots);
+	swap(endpoint->nr_slots, nr_slots);
+	swap(endpoint->slot_size, slot_size);
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (user_buffer)
-		kfree(user_buffer);
-	if (urb) {
-		usb_free_coherent(dev->udev, stuffed_size, buf, urb->transfer_dma);
-		usb_free_urb(urb);
-	}
-	up(&endpoint->limit_sem);
+	if (endpoint->armed && !dev->state.disconnected)
+		retval = mk2_read_submit_all(endpoint);
+
+	// Old slots, now that they were swapped out
+	mk2_read_slots_free(dev, slots, nr_slots, slot_size);
 
 exit:
+	mutex_unlock(&endpoint->urbs_mutex);
 	return retval;
 }
 
-static void mk2_read_bulk_callback(struct urb *urb)
+static ssize_t write_depth_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	struct mk2dev *dev;
-	unsigned long irqstate;
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
 
-	dev = urb->context;
+	return sprintf(buf, "%u\n", READ_ONCE(dev->write_endp.depth));
+}
 
-	spin_lock_irqsave(&dev->read_endp.err_lock, irqstate);
+static ssize_t write_depth_store(struct device *d, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int depth;
+	int retval;
 
-	if (urb->status) {
-		if (!(	urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN))
-				dev_err(&dev->interface->dev,
-					"%s - nonzero write bulk status received: %d\n",
-					__func__, urb->status);
+	retval = kstrtouint(buf, 0, &depth);
+	if (retval)
+		return retval;
 
-		dev->read_endp.errors = urb->status;
-	} else {
-		dev->read_endp.buffer.filled = urb->actual_length;
-	}
+	if (depth < 1 || depth > MK2_MAX_WRITE_DEPTH)
+		return -EINVAL;
 
-	printk(KERN_DEBUG "mk2 read (size): %u\n", urb->actual_length);
-	print_hex_dump(KERN_DEBUG, "mk2 read (raw): ", DUMP_PREFIX_ADDRESS,
-			16, 1, dev->read_endp.buffer.data, urb->actual_length, true);
+	if (mutex_lock_interruptible(&dev->write_endp.io_mutex))
+		return -ERESTARTSYS;
 
-	dev->read_endp.requested_read = 0;
-	spin_unlock_irqrestore(&dev->read_endp.err_lock, irqstate);
-	wake_up_interruptible(&dev->read_endp.wait_queue);
+	retval = mk2_write_pool_resize(&dev->write_endp, depth);
+	mutex_unlock(&dev->write_endp.io_mutex);
+
+	return retval ? retval : count;
 }
+static DEVICE_ATTR_RW(write_depth);
 
-static int mk2_request_read(struct mk2_read_endp *endpoint, size_t count)
+static ssize_t read_buffer_size_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	struct mk2dev *dev;
-	int retval;
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
 
-	printk(KERN_DEBUG "%s: count: %lu\n", __func__, count);
-
-	dev = container_of(endpoint, struct mk2dev, read_endp);
-
-	usb_fill_bulk_urb(endpoint->urb,
-			dev->udev,
-			usb_rcvbulkpipe(dev->udev, endpoint->address),
-			endpoint->buffer.data,
-			endpoint->buffer.size,
-			mk2_read_bulk_callback,
-			dev);
+	return sprintf(buf, "%zu\n", READ_ONCE(dev->read_endp.slot_size));
+}
 
-	spin_lock_irq(&endpoint->err_lock);
-	endpoint->requested_read = 1;
-	spin_unlock_irq(&endpoint->err_lock);
+static ssize_t read_buffer_size_store(struct device *d, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int size;
+	int retval;
 
-	endpoint->buffer.filled = 0;
-	endpoint->buffer.copied = 0;
+	retval = kstrtouint(buf, 0, &size);
+	if (retval)
+		return retval;
 
-	retval = usb_submit_urb(endpoint->urb, GFP_KERNEL);
-	if (retval < 0) {
-		dev_err(&dev->interface->dev,
-			"%s - failed submitting read urb, error %d\n",
-			__func__, retval);
+	retval = mk2_read_pool_resize(&dev->read_endp, 0,
+				      mk2_read_buffer_size(&dev->read_endp, size));
 
-		retval = (retval == -ENOMEM) ? retval : -EIO;
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(read_buffer_size);
 
-		spin_lock_irq(&endpoint->err_lock);
-		endpoint->requested_read = 0;
-		spin_unlock_irq(&endpoint->err_lock);
-	}
+static ssize_t read_urbs_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
 
-	return retval;
+	return sprintf(buf, "%u\n", READ_ONCE(dev->read_endp.nr_slots));
 }
 
-static int parse_buffered_data(struct mk2_read_buffer *read_buffer, char __user *user_buffer, size_t user_size)
+static ssize_t read_urbs_store(struct device *d, struct device_attribute *attr,
+			       const char *buf, size_t count)
 {
-	const size_t leftover = read_buffer->filled - read_buffer->copied;
-	unsigned rb_index = 0; // index into read_buffer
-	unsigned rem_size = user_size;
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int nr;
 	int retval;
 
-	// We should be sanitizing this at the very beginning of the syscall
-	BUG_ON(user_size == 0);
+	retval = kstrtouint(buf, 0, &nr);
+	if (retval)
+		return retval;
 
-	// We should never enter parse_buffered_data without leftover data
-	BUG_ON(leftover == 0);
+	if (nr < 1 || nr > MK2_MAX_READ_URBS)
+		return -EINVAL;
 
-	retval = 0;
-	while (rb_index < leftover) {
-		unsigned batch_size;
-		switch (read_buffer->data[rb_index] & 0x0f) {
-			case MK2_SYSEX_MOREDATA:
-			case MK2_SYSEX_BUTTON:
-			case MK2_SYSEX_SBUTTON:
-				batch_size = 3;
-				break;
+	retval = mk2_read_pool_resize(&dev->read_endp, nr, 0);
 
-			case MK2_SYSEX_DATAEND1:
-				batch_size = 1;
-				break;
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(read_urbs);
 
-			case MK2_SYSEX_DATAEND2:
-				batch_size = 2;
-				break;
+static ssize_t refresh_rate_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
 
-			case MK2_SYSEX_DATAEND3:
-				batch_size = 0;
-				break;
+	return sprintf(buf, "%u\n", READ_ONCE(dev->fb.refresh_rate));
+}
 
-			default:
-				// Data we got from device doesn't make sense
-				// or we messud up during parsing or our
-				// internal caches
-				return -EFAULT;
-		}
+static ssize_t refresh_rate_store(struct device *d, struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct mk2dev *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int rate;
+	int retval;
 
-		if (rem_size < batch_size)
-			break;
+	retval = kstrtouint(buf, 0, &rate);
+	if (retval)
+		return retval;
 
-		// Metadata is telling us that we should have more data in the
-		// payload than we have.  It doesn't make any sense, something
-		// went horribly wrong.
-		//
-		// TODO: perhaps we should close user file pointer and reset
-		// the device
-		if (unlikely(rb_index + MK2_STUFFED_PACKET_SIZE > leftover))
-			return -EFAULT;
+	if (rate > MK2_MAX_REFRESH_RATE)
+		return -EINVAL;
 
-		// Copy payload to user
-		if (copy_to_user(user_buffer, read_buffer->data + read_buffer->copied + rb_index + 1, batch_size))
-			return -EFAULT;
+	if (mutex_lock_interruptible(&dev->fb.lock))
+		return -ERESTARTSYS;
 
-		retval      += batch_size;
-		rb_index    += MK2_STUFFED_PACKET_SIZE;
-		user_buffer += batch_size;
-		rem_size    -= batch_size;
-	}
+	mk2_fb_set_refresh_rate(dev, rate);
+	mutex_unlock(&dev->fb.lock);
 
-	read_buffer->copied += rb_index;
+	return count;
+}
+static DEVICE_ATTR_RW(refresh_rate);
+
+static struct attribute *mk2_attrs[] = {
+	&dev_attr_write_depth.attr,
+	&dev_attr_read_buffer_size.attr,
+	&dev_attr_read_urbs.attr,
+	&dev_attr_refresh_rate.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(mk2);
 
-	return retval;
+static void mk2_stats_sum(struct mk2dev *dev, struct mk2_stats *sum)
+{
+	struct mk2_stats *stats;
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(dev->stats, cpu);
+
+		sum->write_submitted += stats->write_submitted;
+		sum->write_completed += stats->write_completed;
+		sum->write_payload_bytes += stats->write_payload_bytes;
+		sum->write_stuffed_bytes += stats->write_stuffed_bytes;
+		sum->write_blocked_ns += stats->write_blocked_ns;
+		sum->read_submitted += stats->read_submitted;
+		sum->read_completed += stats->read_completed;
+		sum->read_events += stats->read_events;
+		sum->read_overruns += stats->read_overruns;
+
+		for (i = 0; i < MK2_STAT_STATUSES; ++i) {
+			sum->write_status[i] += stats->write_status[i];
+			sum->read_status[i] += stats->read_status[i];
+		}
+	}
 }
 
-static ssize_t mk2_read(struct file *filp, char __user *user_buffer, size_t count, loff_t *ppos)
+static void mk2_stats_show_statuses(struct seq_file *m, const char *prefix,
+				    const u64 *status)
 {
-	struct mk2dev *dev;
-	struct mk2_read_endp *endpoint;
-	int retval;
-	size_t leftover;
-	bool requested_read;
+	unsigned int i;
 
-	dev = filp->private_data;
-	endpoint = &dev->read_endp;
+	for (i = 0; i < ARRAY_SIZE(mk2_stat_statuses); ++i)
+		seq_printf(m, "%s_%s: %llu\n", prefix,
+			   mk2_stat_statuses[i].name, status[i]);
 
-	// TODO: add support for smaller reads
-	if (count < MK2_SYSEX_PACKET_SIZE)
-		return -EINVAL;
+	seq_printf(m, "%s_other: %llu\n", prefix, status[i]);
+}
 
-	retval = mutex_lock_interruptible(&endpoint->io_mutex);
-	if (retval < 0)
-		return retval;
-	
-	if (dev->state.disconnected) {
-		retval = -ENODEV;
-		goto exit;
-	}
+static int mk2_stats_show(struct seq_file *m, void *unused)
+{
+	struct mk2dev *dev = m->private;
+	struct mk2_stats sum;
+
+	mk2_stats_sum(dev, &sum);
+
+	seq_printf(m, "write_urbs_submitted: %llu\n", sum.write_submitted);
+	seq_printf(m, "write_urbs_completed: %llu\n", sum.write_completed);
+	seq_printf(m, "write_payload_bytes: %llu\n", sum.write_payload_bytes);
+	seq_printf(m, "write_stuffed_bytes: %llu\n", sum.write_stuffed_bytes);
+	seq_printf(m, "write_in_flight: %u\n", READ_ONCE(dev->write_endp.in_flight));
+	seq_printf(m, "write_in_flight_peak: %u\n",
+		   READ_ONCE(dev->write_endp.peak_in_flight));
+	seq_printf(m, "write_depth: %u\n", READ_ONCE(dev->write_endp.depth));
+	seq_printf(m, "write_blocked_ns: %llu\n", sum.write_blocked_ns);
+	mk2_stats_show_statuses(m, "write_status", sum.write_status);
+
+	seq_printf(m, "read_urbs_submitted: %llu\n", sum.read_submitted);
+	seq_printf(m, "read_urbs_completed: %llu\n", sum.read_completed);
+	seq_printf(m, "read_events: %llu\n", sum.read_events);
+	seq_printf(m, "read_overruns: %llu\n", sum.read_overruns);
+	mk2_stats_show_statuses(m, "read_status", sum.read_status);
 
-retry:
-	spin_lock_irq(&endpoint->err_lock);
-	requested_read = endpoint->requested_read;
-	spin_unlock_irq(&endpoint->err_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mk2_stats);
 
-	if (requested_read) {
-		if (filp->f_flags & O_NONBLOCK) {
-			retval = -EAGAIN;
-			goto exit;
+/*
+ * Prints the histogram at offset within struct mk2_stats, summed over cpus
+ */
+static void mk2_hist_show(struct seq_file *m, size_t offset)
+{
+	struct mk2dev *dev = m->private;
+	const u64 *hist;
+	u64 count;
+	unsigned int i;
+	int cpu;
+
+	for (i = 0; i < MK2_HIST_BUCKETS; ++i) {
+		count = 0;
+		for_each_possible_cpu(cpu) {
+			hist = (void *)per_cpu_ptr(dev->stats, cpu) + offset;
+			count += hist[i];
 		}
 
-		printk(KERN_DEBUG "%s: waiting\n", __func__);
-		retval = wait_event_interruptible(endpoint->wait_queue,
-						(!endpoint->requested_read));
-						// not needed parenthesis ?
-		if (retval < 0)
-			goto exit;
-	}
-
-	// At this point no read is requested.
-	// One was never started or returned.
-	// So check for errors.
-	retval = endpoint->errors;
-	if (retval < 0) {
-		endpoint->errors = 0;
-		retval = (retval == -EPIPE) ? retval : -EIO;
-		goto exit;
+		if (i == MK2_HIST_BUCKETS - 1)
+			seq_printf(m, "%llu- ns: %llu\n", 1ULL << i, count);
+		else
+			seq_printf(m, "%llu-%llu ns: %llu\n", i ? 1ULL << i : 0,
+				   (1ULL << (i + 1)) - 1, count);
 	}
+}
 
-	// If data was read from device but not copied to user last time
-	// its still in the buffer, return leftover to the user.
-	// Otherwise immediately start read_request and try again.
-	leftover = endpoint->buffer.filled - endpoint->buffer.copied;
-	if (leftover) {
-		printk(KERN_DEBUG "%s: got leftover: %lu\n", __func__, leftover);
-
-		retval = parse_buffered_data(&endpoint->buffer, user_buffer, count);
+static int mk2_write_latency_show(struct seq_file *m, void *unused)
+{
+	mk2_hist_show(m, offsetof(struct mk2_stats, write_latency));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mk2_write_latency);
 
-		// If user wanted to read more, but it was not in the caches,
-		// then prefetch ahead of time.
-		if (unlikely(retval < count))
-			mk2_request_read(endpoint, compute_stuffed_size(count - retval));
-	} else {
-		printk(KERN_DEBUG "%s: no leftover\n", __func__);
+static int mk2_read_latency_show(struct seq_file *m, void *unused)
+{
+	mk2_hist_show(m, offsetof(struct mk2_stats, read_latency));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mk2_read_latency);
 
-		retval = mk2_request_read(endpoint, count);
-		if (retval < 0)
-			goto exit;
-		else
-			goto retry;
+/*
+ * Writing anything clears both histograms. Updates racing with the reset
+ * on other cpus may survive it.
+ */
+static ssize_t mk2_hist_reset_write(struct file *file, const char __user *user_buffer,
+				    size_t count, loff_t *ppos)
+{
+	struct mk2dev *dev = file->private_data;
+	struct mk2_stats *stats;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(dev->stats, cpu);
+		memset(stats->write_latency, 0, sizeof(stats->write_latency));
+		memset(stats->read_latency, 0, sizeof(stats->read_latency));
 	}
 
-exit:
-	mutex_unlock(&endpoint->io_mutex);
-	return retval;
+	return count;
 }
 
-static const struct file_operations mk2_fops = {
-	.owner   =	THIS_MODULE,
-	.read    =	mk2_read,
-	.write   =	mk2_write,
-	.open    =	mk2_open,
-	.release =	mk2_release,
-	.llseek  =	noop_llseek,
+static const struct file_operations mk2_hist_reset_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.write =	mk2_hist_reset_write,
+	.llseek =	noop_llseek,
 };
 
-static struct usb_class_driver mk2_class = {
-	.name =		"mk2-%d",
-	.fops =		&mk2_fops,
-	.minor_base = 	USB_MK2_MINOR_BASE,
-};
+static void mk2_debugfs_init(struct mk2dev *dev)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "mk2-%d", dev->interface->minor);
+
+	dev->debugfs = debugfs_create_dir(name, mk2_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev, &mk2_stats_fops);
+	debugfs_create_file("write_latency", 0444, dev->debugfs, dev,
+			    &mk2_write_latency_fops);
+	debugfs_create_file("read_latency", 0444, dev->debugfs, dev,
+			    &mk2_read_latency_fops);
+	debugfs_create_file("reset_latency", 0200, dev->debugfs, dev,
+			    &mk2_hist_reset_fops);
+}
 
 static int mk2_probe(struct usb_interface *interface,
 		     const struct usb_device_id *id)
@@ -611,19 +3716,55 @@ static int mk2_probe(struct usb_interface *interface,
 	kref_init(&dev->kref);
 
 	// Initialize read endpoints kernel structures
+	init_usb_anchor(&dev->read_endp.submitted);
+	mutex_init(&dev->read_endp.urbs_mutex);
 	mutex_init(&dev->read_endp.io_mutex);
 	init_waitqueue_head(&dev->read_endp.wait_queue);
 	spin_lock_init(&dev->read_endp.err_lock);
+	INIT_DELAYED_WORK(&dev->read_endp.recover_work, mk2_read_recover);
 
 	// Initialize write endpoints kernel structures
 	init_usb_anchor(&dev->write_endp.submitted);
-	sema_init(&dev->write_endp.limit_sem, WRITES_IN_FLIGHT);
+	sema_init(&dev->write_endp.limit_sem, 0);
+	INIT_LIST_HEAD(&dev->write_endp.free_slots);
+	spin_lock_init(&dev->write_endp.slots_lock);
+	hrtimer_init(&dev->write_endp.coalesce_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS_SOFT);
+	dev->write_endp.coalesce_timer.function = mk2_coalesce_timeout;
 	mutex_init(&dev->write_endp.io_mutex);
+	sema_init(&dev->write_endp.prio_sem, 1);
+	mutex_init(&dev->write_endp.prio_mutex);
+	INIT_LIST_HEAD(&dev->write_endp.sched_queue);
+	spin_lock_init(&dev->write_endp.sched_lock);
+	init_waitqueue_head(&dev->write_endp.sched_wait);
+	INIT_LIST_HEAD(&dev->write_endp.timed);
+	spin_lock_init(&dev->write_endp.timed_lock);
+	hrtimer_init(&dev->write_endp.timed_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	dev->write_endp.timed_timer.function = mk2_timed_expire;
+	init_waitqueue_head(&dev->write_endp.wait_queue);
 	spin_lock_init(&dev->write_endp.err_lock);
 
+	// Initialize framebuffer kernel structures
+	mutex_init(&dev->fb.lock);
+	INIT_WORK(&dev->fb.work, mk2_fb_work);
+	hrtimer_init(&dev->fb.vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	dev->fb.vblank_timer.function = mk2_fb_vblank;
+	spin_lock_init(&dev->fb.vblank_lock);
+	init_waitqueue_head(&dev->fb.vblank_wait);
+	hrtimer_init(&dev->clip.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	dev->clip.timer.function = mk2_clip_tick;
+	INIT_WORK(&dev->clip.work, mk2_clip_work);
+	spin_lock_init(&dev->react.lock);
+
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = usb_get_intf(interface);
 
+	dev->stats = alloc_percpu(struct mk2_stats);
+	if (!dev->stats) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
 	retval = usb_find_common_endpoints(interface->cur_altsetting,
 					   &bulk_in, &bulk_out, NULL, NULL);
 	if (retval) {
@@ -632,19 +3773,38 @@ static int mk2_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	retval = kfifo_alloc(&dev->read_endp.events,
+			     clamp_val(event_queue_size, 2, MK2_MAX_EVENT_QUEUE_SIZE),
+			     GFP_KERNEL);
+	if (retval)
+		goto error;
+
 	dev->read_endp.address = bulk_in->bEndpointAddress;
-	if (!mk2_read_buffer_alloc(&dev->read_endp.buffer, usb_endpoint_maxp(bulk_in))) {
+	dev->read_endp.maxp = usb_endpoint_maxp(bulk_in);
+	retval = mk2_read_pool_resize(&dev->read_endp,
+				      clamp_val(read_urbs, 1, MK2_MAX_READ_URBS),
+				      mk2_read_buffer_size(&dev->read_endp, read_buffer_size));
+	if (retval)
+		goto error;
+
+	dev->write_endp.address = bulk_out->bEndpointAddress;
+	retval = mk2_write_pool_resize(&dev->write_endp,
+				       clamp_val(write_depth, 1, MK2_MAX_WRITE_DEPTH));
+	if (retval)
+		goto error;
+
+	dev->write_endp.prio_slot = mk2_write_slot_alloc(dev);
+	if (!dev->write_endp.prio_slot) {
 		retval = -ENOMEM;
 		goto error;
 	}
-	dev->read_endp.urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dev->read_endp.urb) {
+
+	dev->fb.pages = vmalloc_user(MK2_FB_BUFFERS * PAGE_SIZE);
+	if (!dev->fb.pages) {
 		retval = -ENOMEM;
 		goto error;
 	}
 
-	dev->write_endp.address = bulk_out->bEndpointAddress;
-
 	usb_set_intfdata(interface, dev);
 
 	retval = usb_register_dev(interface, &mk2_class);
@@ -655,6 +3815,13 @@ static int mk2_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	// Only once nothing can fail, error path doesn't stop the vblank timer
+	mutex_lock(&dev->fb.lock);
+	mk2_fb_set_refresh_rate(dev, min_t(unsigned int, refresh_rate, MK2_MAX_REFRESH_RATE));
+	mutex_unlock(&dev->fb.lock);
+
+	mk2_debugfs_init(dev);
+
 	dev_info(&interface->dev,
 		"USB MK2 device now attached to mk2-%d",
 		interface->minor);
@@ -674,15 +3841,35 @@ static void mk2_disconnect(struct usb_interface *interface)
 	usb_set_intfdata(interface, NULL);
 
 	usb_deregister_dev(interface, &mk2_class);
+	debugfs_remove_recursive(dev->debugfs);
 
 	mutex_lock(&dev->read_endp.io_mutex);
+	mutex_lock(&dev->read_endp.urbs_mutex);
 	mutex_lock(&dev->write_endp.io_mutex);
+	spin_lock_irq(&dev->write_endp.slots_lock);
 	dev->state.disconnected = 1;
+	spin_unlock_irq(&dev->write_endp.slots_lock);
 	mutex_unlock(&dev->write_endp.io_mutex);
+	mutex_unlock(&dev->read_endp.urbs_mutex);
 	mutex_unlock(&dev->read_endp.io_mutex);
 
-	usb_kill_urb(dev->read_endp.urb);
+	usb_kill_anchored_urbs(&dev->read_endp.submitted);
+	cancel_delayed_work_sync(&dev->read_endp.recover_work);
+	wake_up_interruptible(&dev->read_endp.wait_queue);
 	usb_kill_anchored_urbs(&dev->write_endp.submitted);
+	wake_up_interruptible(&dev->write_endp.wait_queue);
+	wake_up_all(&dev->write_endp.sched_wait);
+	hrtimer_cancel(&dev->write_endp.coalesce_timer);
+	hrtimer_cancel(&dev->write_endp.timed_timer);
+	WRITE_ONCE(dev->fb.vblank_ns, 0);
+	hrtimer_cancel(&dev->fb.vblank_timer);
+	wake_up_all(&dev->fb.vblank_wait);
+	// Playing clip holds an autopm reference, stop drops it
+	mutex_lock(&dev->fb.lock);
+	mk2_clip_stop(dev);
+	mutex_unlock(&dev->fb.lock);
+	cancel_work_sync(&dev->clip.work);
+	cancel_work_sync(&dev->fb.work);
 
 	kref_put(&dev->kref, mk2_delete);
 	dev_info(&interface->dev, "USB mk2 #%d now disconnceted", minor);
@@ -693,9 +3880,34 @@ static struct usb_driver mk2_driver = {
 	.probe = mk2_probe,
 	.disconnect = mk2_disconnect,
 	.id_table = mk2_idtable,
+	.dev_groups = mk2_groups,
 	.supports_autosuspend = 1,
 };
-module_usb_driver(mk2_driver);
+
+static int __init mk2_init(void)
+{
+	int retval;
+
+	mk2_stuff_buffer(mk2_stuffed_header, (const char *)mk2_sysex_header,
+			 sizeof(mk2_sysex_header), false);
+
+	mk2_debugfs_root = debugfs_create_dir("mk2", NULL);
+
+	retval = usb_register(&mk2_driver);
+	if (retval)
+		debugfs_remove_recursive(mk2_debugfs_root);
+
+	return retval;
+}
+
+static void __exit mk2_exit(void)
+{
+	usb_deregister(&mk2_driver);
+	debugfs_remove_recursive(mk2_debugfs_root);
+}
+
+module_init(mk2_init);
+module_exit(mk2_exit);
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_DESCRIPTION(DESCRIPTION);
@@ -0,0 +1,321 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace interface of the novation mk2 launchpad driver.
+ */
+#ifndef _MK2_H
+#define _MK2_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Number of LEDs the device has. LED index in struct mk2_frame maps to
+ * the device as follows:
+ *   0 - 71   rows from the bottom up, 9 LEDs each (8 pads and the side
+ *            button), that is LED n is (n / 9 + 1) * 10 + n % 9 + 1
+ *   72 - 79  top row buttons from left to right
+ */
+#define MK2_LED_COUNT		80
+#define MK2_GRID_LED_COUNT	72
+
+#define MK2_PALETTE_MAX		127
+#define MK2_RGB_MAX		63
+
+/*
+ * Colour of a single LED. When palette is nonzero the LED shows that
+ * palette colour and red, green and blue are ignored. Otherwise the LED
+ * shows the rgb colour, each component in range 0 - MK2_RGB_MAX.
+ */
+struct mk2_led {
+	__u8	red;
+	__u8	green;
+	__u8	blue;
+	__u8	palette;
+};
+
+struct mk2_frame {
+	struct mk2_led	leds[MK2_LED_COUNT];
+};
+
+#define MK2_IOC_MAGIC		'N'
+
+/*
+ * Displays the whole frame. Only LEDs that differ from the previously
+ * committed frame are sent to the device.
+ */
+#define MK2_IOC_COMMIT_FRAME	_IOW(MK2_IOC_MAGIC, 0x00, struct mk2_frame)
+
+/*
+ * Forgets what the device displays, for example after raw sysex was
+ * written to it. The next commit sends every LED.
+ */
+#define MK2_IOC_INVALIDATE	_IO(MK2_IOC_MAGIC, 0x01)
+
+/*
+ * The device node can be mapped to get MK2_FB_BUFFERS framebuffers, each at
+ * the start of its own page (buffer n lives at offset n * page size) and
+ * holding a struct mk2_frame. Userspace draws into the back buffer, buffer 0
+ * initially, and calls MK2_IOC_FLIP to display it. Only LEDs that changed
+ * since the last displayed frame are sent. On success the ioctl returns
+ * index of the new back buffer, which still holds the frame before last.
+ */
+#define MK2_FB_BUFFERS		2
+#define MK2_IOC_FLIP		_IO(MK2_IOC_MAGIC, 0x02)
+
+/*
+ * Per open file flags.
+ *
+ * MK2_FLAG_LATEST_WINS: framebuffer updates made through this file don't
+ * queue up behind a busy pipe. A frame is only sent while at most one write
+ * urb is in flight, otherwise it waits in the driver and is replaced by any
+ * newer frame or LED update. Output lags by at most about one urb and
+ * intermediate frames are dropped.
+ *
+ * MK2_FLAG_TIMESTAMPS: read() on this file returns struct mk2_input_event
+ * records instead of bare MIDI payload. Buffer must fit at least one record
+ * and only whole records are returned.
+ *
+ * MK2_FLAG_PRIORITY: writes and framebuffer updates made through this file
+ * overtake output queued by other files. The driver keeps one urb reserved
+ * for them, so they don't wait for a full queue to drain. A single write may
+ * be at most 408 bytes, larger ones fail with EMSGSIZE. Order relative to
+ * other files' output is not kept.
+ */
+#define MK2_FLAG_LATEST_WINS	(1 << 0)
+#define MK2_FLAG_TIMESTAMPS	(1 << 1)
+#define MK2_FLAG_PRIORITY	(1 << 2)
+#define MK2_FLAGS_ALL		(MK2_FLAG_LATEST_WINS | MK2_FLAG_TIMESTAMPS | \
+				 MK2_FLAG_PRIORITY)
+
+#define MK2_IOC_SET_FLAGS	_IOW(MK2_IOC_MAGIC, 0x03, __u32)
+#define MK2_IOC_GET_FLAGS	_IOR(MK2_IOC_MAGIC, 0x04, __u32)
+
+struct mk2_led_update {
+	__u32		index;
+	struct mk2_led	led;
+};
+
+/*
+ * Changes a single LED of the latest committed frame and displays it.
+ */
+#define MK2_IOC_SET_LED		_IOW(MK2_IOC_MAGIC, 0x05, struct mk2_led_update)
+
+/*
+ * Share of the device a file gets when several files write at once, 1 - 16,
+ * 1 by default. Files with equal weights take turns fairly, measured in
+ * bytes, a file with weight 2 gets twice the bytes of one with weight 1.
+ * A single write is never interleaved with writes of other files. Priority
+ * writes bypass the weights.
+ */
+#define MK2_IOC_SET_WRITE_WEIGHT	_IOW(MK2_IOC_MAGIC, 0x06, __u32)
+#define MK2_IOC_GET_WRITE_WEIGHT	_IOR(MK2_IOC_MAGIC, 0x07, __u32)
+
+/*
+ * Waits at most the given number of milliseconds until all output queued so
+ * far, by any file, has reached the device. Fails with ETIMEDOUT when time
+ * runs out, or with the error a transfer ended with, same as fsync() which
+ * waits without a time limit.
+ */
+#define MK2_IOC_BARRIER		_IOW(MK2_IOC_MAGIC, 0x08, __u32)
+
+struct mk2_vblank {
+	__u64	timestamp;	/* CLOCK_MONOTONIC nanoseconds */
+	__u64	sequence;
+};
+
+/*
+ * When the refresh_rate sysfs attribute is nonzero, framebuffer updates are
+ * collected and only what changed is sent once per refresh period, the
+ * vblank. Waits for the next vblank and returns when and which one it was.
+ * Fails with EINVAL when refresh rate is 0.
+ */
+#define MK2_IOC_WAIT_VBLANK	_IOR(MK2_IOC_MAGIC, 0x09, struct mk2_vblank)
+
+/*
+ * Message to be sent at time, CLOCK_MONOTONIC in nanoseconds. data points to
+ * len bytes of sysex, at most 408, reserved must be 0.
+ */
+struct mk2_timed_message {
+	__u64	time;
+	__u64	data;
+	__u32	len;
+	__u32	reserved;
+};
+
+/*
+ * Queues a message to be sent by the driver at its time, or right away if
+ * the time has passed. Messages with the same time go out in the order they
+ * were queued. Up to 256 messages can wait per device, more fail with
+ * ENOSPC. A message due while the pipe is full goes out as soon as an urb
+ * completes.
+ */
+#define MK2_IOC_QUEUE_TIMED	_IOW(MK2_IOC_MAGIC, 0x0a, struct mk2_timed_message)
+
+/*
+ * Drops every timed message not sent yet.
+ */
+#define MK2_IOC_CLEAR_TIMED	_IO(MK2_IOC_MAGIC, 0x0b)
+
+/*
+ * Clip of frames the driver plays on its own, frames points to nr_frames
+ * struct mk2_frame, at most 4096. reserved must be 0.
+ */
+struct mk2_clip_data {
+	__u64	frames;
+	__u32	nr_frames;
+	__u32	reserved;
+};
+
+/*
+ * Playback loops until stopped instead of stopping at the last frame.
+ */
+#define MK2_CLIP_LOOP		(1 << 0)
+#define MK2_CLIP_FLAGS_ALL	MK2_CLIP_LOOP
+
+/*
+ * rate is in frames per second, 1 - 1000.
+ */
+struct mk2_clip_play {
+	__u32	rate;
+	__u32	flags;
+};
+
+/*
+ * The device keeps a single clip, loading one stops playback and replaces
+ * the previous clip, loading no frames frees it. Playback starts from the
+ * first frame and keeps going after the file is closed. Frames are shown
+ * like MK2_IOC_COMMIT_FRAME in latest wins mode, a frame waiting for room in
+ * the pipe is replaced by the next one, and mix with updates from files.
+ * PLAY_CLIP fails with ENODATA when no clip is loaded. The device is kept
+ * from autosuspending while a clip plays.
+ */
+#define MK2_IOC_LOAD_CLIP	_IOW(MK2_IOC_MAGIC, 0x0c, struct mk2_clip_data)
+#define MK2_IOC_PLAY_CLIP	_IOW(MK2_IOC_MAGIC, 0x0d, struct mk2_clip_play)
+#define MK2_IOC_STOP_CLIP	_IO(MK2_IOC_MAGIC, 0x0e)
+
+#define MK2_REACT_PRESS		0
+#define MK2_REACT_RELEASE	1
+
+/*
+ * Reaction actions.
+ *
+ * MK2_REACT_NONE: no reaction, removes the rule.
+ * MK2_REACT_SET: lights the target LED with led.
+ * MK2_REACT_RESTORE: shows the target LED as the framebuffer has it.
+ * MK2_REACT_FLASH: flashes the target LED in palette colour led.palette.
+ */
+#define MK2_REACT_NONE		0
+#define MK2_REACT_SET		1
+#define MK2_REACT_RESTORE	2
+#define MK2_REACT_FLASH		3
+
+/*
+ * Rule for press or release (edge) of a button. button and target are LED
+ * indexes as in struct mk2_frame, a button lights its own LED when target
+ * equals button. reserved must be 0.
+ */
+struct mk2_reaction {
+	__u32		button;
+	__u32		target;
+	__u8		edge;
+	__u8		action;
+	__u8		reserved[2];
+	struct mk2_led	led;
+};
+
+/*
+ * Reactions are carried out by the driver as soon as the button event
+ * arrives, without waiting for userspace, and the event is still delivered
+ * to readers. Each button has one rule per edge, setting a rule replaces the
+ * previous one. LEDs changed by a reaction are sent again by the next
+ * framebuffer update. Responses share the timed message queue and are
+ * dropped when it is full.
+ */
+#define MK2_IOC_SET_REACTION	_IOW(MK2_IOC_MAGIC, 0x0f, struct mk2_reaction)
+#define MK2_IOC_CLEAR_REACTIONS	_IO(MK2_IOC_MAGIC, 0x10)
+
+/*
+ * Commands of the programmer's reference.
+ *
+ * MK2_OP_SET_LED: LED index shows led, palette or rgb colour.
+ * MK2_OP_FLASH: LED index flashes palette colour led.palette.
+ * MK2_OP_PULSE: LED index pulses palette colour led.palette.
+ * MK2_OP_ROW: row index, 0 - 8 from the bottom with 8 the top row, shows
+ * led.palette.
+ * MK2_OP_COLUMN: column index, 0 - 8 from the left with 8 the side buttons,
+ * shows led.palette.
+ * MK2_OP_ALL: every LED shows led.palette, index must be 0.
+ * MK2_OP_SCROLL_TEXT: scrolls text_len bytes of 7 bit text, at most 256, in
+ * led.palette across the grid, once or with MK2_COMMAND_LOOP until stopped.
+ * Characters 1 - 7 set the speed. No text stops scrolling, index must be 0.
+ *
+ * Commands other than MK2_OP_SET_LED take palette colours only, red, green
+ * and blue must be 0.
+ */
+#define MK2_OP_SET_LED		0
+#define MK2_OP_FLASH		1
+#define MK2_OP_PULSE		2
+#define MK2_OP_ROW		3
+#define MK2_OP_COLUMN		4
+#define MK2_OP_ALL		5
+#define MK2_OP_SCROLL_TEXT	6
+
+#define MK2_COMMAND_LOOP	(1 << 0)
+
+#define MK2_MAX_TEXT_LEN	256
+
+struct mk2_command {
+	__u32		op;
+	__u32		index;
+	struct mk2_led	led;
+	__u32		flags;
+	__u64		text;
+	__u32		text_len;
+	__u32		reserved;
+};
+
+/*
+ * commands points to nr_commands struct mk2_command, at most 64. reserved
+ * must be 0.
+ */
+struct mk2_commands {
+	__u64	commands;
+	__u32	nr_commands;
+	__u32	reserved;
+};
+
+/*
+ * Sends a batch of commands, packed into as few urbs as they fit, in order
+ * and like a write() through this file. An invalid command fails the batch
+ * with EINVAL before anything is sent. LEDs the commands change are sent
+ * again by the next framebuffer update.
+ */
+#define MK2_IOC_COMMANDS	_IOW(MK2_IOC_MAGIC, 0x11, struct mk2_commands)
+
+/*
+ * Input event types, these are USB-MIDI code index numbers of the packet
+ * the event came in.
+ */
+#define MK2_EVENT_SYSEX		0x04	/* sysex continues, 3 bytes */
+#define MK2_EVENT_SYSEX_END1	0x05	/* sysex ends, 1 byte */
+#define MK2_EVENT_SYSEX_END2	0x06	/* sysex ends, 2 bytes */
+#define MK2_EVENT_SYSEX_END3	0x07	/* sysex ends, 3 bytes */
+#define MK2_EVENT_PAD		0x09	/* note on, grid pads and side buttons */
+#define MK2_EVENT_CC		0x0b	/* control change, top row */
+
+/*
+ * Timestamped input record, see MK2_FLAG_TIMESTAMPS. timestamp is
+ * CLOCK_MONOTONIC in nanoseconds taken when the packet was received.
+ * sequence counts every event the driver received, including ones dropped
+ * because the input queue was full, so a gap means lost events. For pad and
+ * CC events data[1] is LED id of the button and data[2] the velocity, 0 on
+ * release.
+ */
+struct mk2_input_event {
+	__u64	timestamp;
+	__u32	sequence;
+	__u8	type;
+	__u8	data[3];
+};
+
+#endif /* _MK2_H */
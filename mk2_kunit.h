@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Internals of the novation mk2 launchpad driver that the KUnit tests in
+ * mk2_test.c reach. Functions listed here are static unless CONFIG_KUNIT
+ * is enabled.
+ */
+#ifndef _MK2_KUNIT_H
+#define _MK2_KUNIT_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <kunit/visibility.h>
+
+// Most events a single read hands to userspace
+#define MK2_READ_BATCH		64
+
+/*
+ * Payload of one USB-MIDI packet received from the device
+ */
+struct mk2_event
+{
+	ktime_t			timestamp;
+	u32			sequence;
+	u8			type;
+	u8			len;
+	// MIDI bytes, the first one in the lowest byte
+	u32			payload;
+};
+
+#if IS_ENABLED(CONFIG_KUNIT)
+void mk2_stuff_buffer(char *buf, const char *payload, size_t count, bool last);
+size_t mk2_stage_events(u8 *staging, size_t size, const struct mk2_event *events,
+			unsigned int *nr_events, bool timestamps);
+#endif
+
+#endif /* _MK2_KUNIT_H */
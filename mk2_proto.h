@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Limits of the novation mk2 launchpad sysex protocol, shared by the driver
+ * and its tests.
+ */
+#ifndef _MK2_PROTO_H
+#define _MK2_PROTO_H
+
+#include <linux/types.h>
+
+// 407 = header + packet * 80 + footer = 6 + 5 * 80 + 1
+#define USB_MK2_MAX_OUT_LEN	((size_t) 407)
+
+#endif /* _MK2_PROTO_H */
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests of the novation mk2 launchpad driver, built when the kernel
+ * has CONFIG_KUNIT enabled.
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/string.h>
+#include <linux/mman.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "mk2.h"
+#include "mk2_proto.h"
+#include "mk2_kunit.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("EXPORTED_FOR_KUNIT_TESTING");
+#else
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif
+
+// Stuffed size of the longest message, whole packets
+#define MK2_TEST_STUFFED_MAX	(DIV_ROUND_UP(USB_MK2_MAX_OUT_LEN, 3) * 4)
+
+// Reads timed by the read benchmark, per path and format
+#define MK2_TEST_READS		10000
+
+// Most a read of a full batch copies, plus the slack staging needs
+#define MK2_TEST_READ_SIZE	(MK2_READ_BATCH * sizeof(struct mk2_input_event))
+#define MK2_TEST_STAGING_SIZE	(MK2_TEST_READ_SIZE + sizeof(u32))
+
+/*
+ * mk2_stuff_buffer as it was before packets were built a word at a time,
+ * code index numbers are the same as the uapi event types.
+ */
+static void mk2_test_stuff_reference(char *buf, const char *payload, size_t count, bool last)
+{
+	size_t blk, rem, oi = 0, ii = 0;
+
+	blk = count / 3;
+	rem = count % 3;
+
+	while (blk > 0) {
+		buf[oi+0] = MK2_EVENT_SYSEX;
+		buf[oi+1] = payload[ii+0];
+		buf[oi+2] = payload[ii+1];
+		buf[oi+3] = payload[ii+2];
+
+		oi += 4;
+		ii += 3;
+		--blk;
+	}
+
+	if (!last)
+		return;
+
+	switch (rem) {
+		case 0:
+			buf[oi-4] = MK2_EVENT_SYSEX_END3;
+			break;
+		case 1:
+			buf[oi+0] = MK2_EVENT_SYSEX_END1;
+			buf[oi+1] = payload[ii+0];
+			buf[oi+2] = 0;
+			buf[oi+3] = 0;
+			break;
+		case 2:
+			buf[oi+0] = MK2_EVENT_SYSEX_END2;
+			buf[oi+1] = payload[ii+0];
+			buf[oi+2] = payload[ii+1];
+			buf[oi+3] = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Compares mk2_stuff_buffer with the reference over every message length,
+ * both ending the message and as a middle part, which comes in whole
+ * packets only. Payload sits at the end of its allocation, so KASAN catches the
+ * word loads reading past it. Untouched output must stay untouched.
+ */
+static void mk2_test_stuff_buffer(struct kunit *test)
+{
+	char *payload, *expected, *actual;
+	const char *p;
+	size_t len;
+	int last;
+
+	payload = kunit_kmalloc(test, USB_MK2_MAX_OUT_LEN, GFP_KERNEL);
+	expected = kunit_kmalloc(test, MK2_TEST_STUFFED_MAX, GFP_KERNEL);
+	actual = kunit_kmalloc(test, MK2_TEST_STUFFED_MAX, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, payload);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, expected);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, actual);
+
+	get_random_bytes(payload, USB_MK2_MAX_OUT_LEN);
+
+	for (len = 1; len <= USB_MK2_MAX_OUT_LEN; ++len) {
+		p = payload + USB_MK2_MAX_OUT_LEN - len;
+
+		for (last = 0; last <= 1; ++last) {
+			if (!last && len % 3)
+				continue;
+
+			memset(expected, 0xa5, MK2_TEST_STUFFED_MAX);
+			memset(actual, 0xa5, MK2_TEST_STUFFED_MAX);
+
+			mk2_test_stuff_reference(expected, p, len, last);
+			mk2_stuff_buffer(actual, p, len, last);
+
+			KUNIT_EXPECT_MEMEQ_MSG(test, actual, expected, MK2_TEST_STUFFED_MAX,
+					       "len %zu last %d", len, last);
+		}
+	}
+}
+
+/*
+ * Read as it was before staging, one copy_to_user per event. Returns bytes
+ * copied or -EFAULT.
+ */
+static ssize_t mk2_test_read_reference(char __user *ubuf, const struct mk2_event *events,
+				       unsigned int nr_events, bool timestamps)
+{
+	struct mk2_input_event record = {};
+	u8 data[3];
+	size_t copied = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr_events; ++i) {
+		const struct mk2_event *event = &events[i];
+
+		data[0] = event->payload;
+		data[1] = event->payload >> 8;
+		data[2] = event->payload >> 16;
+
+		if (timestamps) {
+			record.timestamp = ktime_to_ns(event->timestamp);
+			record.sequence = event->sequence;
+			record.type = event->type;
+			memcpy(record.data, data, sizeof(record.data));
+
+			if (copy_to_user(ubuf + copied, &record, sizeof(record)))
+				return -EFAULT;
+			copied += sizeof(record);
+		} else {
+			if (copy_to_user(ubuf + copied, data, event->len))
+				return -EFAULT;
+			copied += event->len;
+		}
+	}
+
+	return copied;
+}
+
+/*
+ * Read as mk2_read does it, events staged and copied at once.
+ */
+static ssize_t mk2_test_read_staged(char __user *ubuf, u8 *staging,
+				    const struct mk2_event *events,
+				    unsigned int nr_events, bool timestamps)
+{
+	size_t staged;
+
+	staged = mk2_stage_events(staging, MK2_TEST_READ_SIZE, events, &nr_events,
+				  timestamps);
+	if (copy_to_user(ubuf, staging, staged))
+		return -EFAULT;
+
+	return staged;
+}
+
+/*
+ * A batch of button events with some sysex in between, about what a busy
+ * device hands a reader.
+ */
+static void mk2_test_fill_events(struct mk2_event *events)
+{
+	static const u8 types[] = {
+		MK2_EVENT_PAD, MK2_EVENT_CC, MK2_EVENT_SYSEX, MK2_EVENT_SYSEX_END1,
+		MK2_EVENT_SYSEX_END2, MK2_EVENT_SYSEX_END3,
+	};
+	static const u8 lens[] = { 3, 3, 3, 1, 2, 3 };
+	unsigned int i, t;
+
+	for (i = 0; i < MK2_READ_BATCH; ++i) {
+		t = get_random_u32_below(ARRAY_SIZE(types));
+
+		events[i].timestamp = ktime_get();
+		events[i].sequence = i;
+		events[i].type = types[t];
+		events[i].len = lens[t];
+		events[i].payload = get_random_u32() & (0xffffff >> (8 * (3 - lens[t])));
+	}
+}
+
+/*
+ * Checks that a staged read hands userspace the same bytes as the per
+ * event copies did, then times both over a full batch. Reports the
+ * speedup rather than asserting it, timing depends on the machine.
+ */
+static void mk2_test_read_bench(struct kunit *test)
+{
+	struct mk2_event *events;
+	u8 *staging, *expected, *actual;
+	unsigned long uaddr;
+	char __user *ubuf;
+	ssize_t ref_len, staged_len;
+	ktime_t start;
+	s64 ref_ns, staged_ns;
+	unsigned int i;
+	int timestamps;
+
+	events = kunit_kmalloc(test, MK2_READ_BATCH * sizeof(*events), GFP_KERNEL);
+	staging = kunit_kmalloc(test, MK2_TEST_STAGING_SIZE, GFP_KERNEL);
+	expected = kunit_kmalloc(test, MK2_TEST_READ_SIZE, GFP_KERNEL);
+	actual = kunit_kmalloc(test, MK2_TEST_READ_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, events);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, staging);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, expected);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, actual);
+
+	uaddr = kunit_vm_mmap(test, NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	if (IS_ERR_VALUE(uaddr))
+		kunit_skip(test, "no userspace mapping for the read buffer");
+	ubuf = (char __user *)uaddr;
+
+	mk2_test_fill_events(events);
+
+	for (timestamps = 0; timestamps <= 1; ++timestamps) {
+		ref_len = mk2_test_read_reference(ubuf, events, MK2_READ_BATCH, timestamps);
+		KUNIT_ASSERT_GT(test, ref_len, 0);
+		KUNIT_ASSERT_EQ(test, copy_from_user(expected, ubuf, ref_len), 0);
+
+		staged_len = mk2_test_read_staged(ubuf, staging, events, MK2_READ_BATCH,
+						  timestamps);
+		KUNIT_ASSERT_EQ(test, staged_len, ref_len);
+		KUNIT_ASSERT_EQ(test, copy_from_user(actual, ubuf, staged_len), 0);
+		KUNIT_EXPECT_MEMEQ_MSG(test, actual, expected, ref_len,
+				       "timestamps %d", timestamps);
+
+		start = ktime_get();
+		for (i = 0; i < MK2_TEST_READS; ++i)
+			mk2_test_read_reference(ubuf, events, MK2_READ_BATCH, timestamps);
+		ref_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		for (i = 0; i < MK2_TEST_READS; ++i)
+			mk2_test_read_staged(ubuf, staging, events, MK2_READ_BATCH, timestamps);
+		staged_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		kunit_info(test, "%s read of %u events: per event %lld ns, staged %lld ns, %lld.%02lldx\n",
+			   timestamps ? "timestamped" : "payload", MK2_READ_BATCH,
+			   ref_ns / MK2_TEST_READS, staged_ns / MK2_TEST_READS,
+			   ref_ns / max_t(s64, staged_ns, 1),
+			   ref_ns * 100 / max_t(s64, staged_ns, 1) % 100);
+	}
+}
+
+static struct kunit_case mk2_test_cases[] = {
+	KUNIT_CASE(mk2_test_stuff_buffer),
+	KUNIT_CASE_SLOW(mk2_test_read_bench),
+	{}
+};
+
+static struct kunit_suite mk2_test_suite = {
+	.name = "mk2",
+	.test_cases = mk2_test_cases,
+};
+kunit_test_suite(mk2_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for novation mk2 launchpad driver");
+MODULE_LICENSE("GPL v2");
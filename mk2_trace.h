@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the novation mk2 launchpad driver. Devices are identified
+ * by their usb minor, same as in mk2-%d node names.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mk2
+
+#if !defined(_MK2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MK2_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+TRACE_EVENT(mk2_write_submit,
+	TP_PROTO(int minor, unsigned int len, unsigned int in_flight, int ret),
+	TP_ARGS(minor, len, in_flight, ret),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(unsigned int,	len)
+		__field(unsigned int,	in_flight)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->len = len;
+		__entry->in_flight = in_flight;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mk2-%d len=%u in_flight=%u ret=%d",
+		  __entry->minor, __entry->len, __entry->in_flight, __entry->ret)
+);
+
+TRACE_EVENT(mk2_write_complete,
+	TP_PROTO(int minor, unsigned int len, int status, s64 latency_ns),
+	TP_ARGS(minor, len, status, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(unsigned int,	len)
+		__field(int,		status)
+		__field(s64,		latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->len = len;
+		__entry->status = status;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("mk2-%d len=%u status=%d latency=%lldns",
+		  __entry->minor, __entry->len, __entry->status, __entry->latency_ns)
+);
+
+TRACE_EVENT(mk2_read_submit,
+	TP_PROTO(int minor, unsigned int len, int ret),
+	TP_ARGS(minor, len, ret),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(unsigned int,	len)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mk2-%d len=%u ret=%d",
+		  __entry->minor, __entry->len, __entry->ret)
+);
+
+/*
+ * Latency of a read is how long the urb waited for input, mostly idle time.
+ */
+TRACE_EVENT(mk2_read_complete,
+	TP_PROTO(int minor, unsigned int len, int status, s64 latency_ns),
+	TP_ARGS(minor, len, status, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(unsigned int,	len)
+		__field(int,		status)
+		__field(s64,		latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->len = len;
+		__entry->status = status;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("mk2-%d len=%u status=%d latency=%lldns",
+		  __entry->minor, __entry->len, __entry->status, __entry->latency_ns)
+);
+
+TRACE_EVENT(mk2_decode,
+	TP_PROTO(int minor, u8 type, u32 payload, u32 sequence, bool dropped),
+	TP_ARGS(minor, type, payload, sequence, dropped),
+
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(u8,		type)
+		__field(u32,		payload)
+		__field(u32,		sequence)
+		__field(bool,		dropped)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->type = type;
+		__entry->payload = payload;
+		__entry->sequence = sequence;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("mk2-%d type=%#x data=%02x %02x %02x seq=%u%s",
+		  __entry->minor, __entry->type,
+		  __entry->payload & 0xff, (__entry->payload >> 8) & 0xff,
+		  (__entry->payload >> 16) & 0xff, __entry->sequence,
+		  __entry->dropped ? " dropped" : "")
+);
+
+#endif /* _MK2_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE mk2_trace
+#include <trace/define_trace.h>